@@ -3,13 +3,25 @@
 #include "Color.hpp"
 
 #include <string>
+#include <vector>
+#include <memory>
 
 typedef float Cost;
 
+//a difference function with the yarn colors fixed, for computing the costs of many pixels at once (see Difference::batch):
+struct DifferenceBatch {
+	virtual ~DifferenceBatch() { }
+	//costs[i * yarns + y] = difference(pixels[i], yarns[y]) for every i in [0, count)
+	// (these are exactly the values calling the difference on each pair would give)
+	virtual void operator()(Color::Linear const *pixels, uint32_t count, Cost *costs) const = 0;
+};
+
 struct Difference {
 	virtual Cost operator()(Color::Linear const &a, Color::Linear const &b) const = 0;
 	virtual std::string name() const = 0;
 	virtual std::string help() const = 0;
+	//make a batch for these yarn colors (the default version just calls operator() on every pair; see difference.cpp):
+	virtual std::unique_ptr< DifferenceBatch > batch(std::vector< Color::Linear > const &yarns) const;
 };
 
 struct SRGBDifference : Difference {
@@ -23,6 +35,7 @@ struct SRGBDifference : Difference {
 	}
 	virtual std::string name() const override { return "srgb"; }
 	virtual std::string help() const override { return "squared difference of srgb-encoded color values (component values in range [0,1])"; }
+	virtual std::unique_ptr< DifferenceBatch > batch(std::vector< Color::Linear > const &yarns) const override;
 };
 
 struct LinearDifference : Difference {
@@ -33,6 +46,7 @@ struct LinearDifference : Difference {
 	}
 	virtual std::string name() const override { return "linear"; }
 	virtual std::string help() const override { return "squared difference of linear rgb color values (component values in range [0,1])"; }
+	virtual std::unique_ptr< DifferenceBatch > batch(std::vector< Color::Linear > const &yarns) const override;
 };
 
 struct OKLabDifference : Difference {
@@ -46,6 +60,7 @@ struct OKLabDifference : Difference {
 	}
 	virtual std::string name() const override { return "oklab"; }
 	virtual std::string help() const override { return "squared difference of linear Oklab color values (component values in range [0,1])"; }
+	virtual std::unique_ptr< DifferenceBatch > batch(std::vector< Color::Linear > const &yarns) const override;
 };
 
 
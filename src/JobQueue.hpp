@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <algorithm>
+
+//simple pool of worker threads; run() queues jobs and wait() blocks until all queued jobs are finished:
+struct JobQueue {
+	struct Shared {
+		std::deque< std::function< void() > > queue;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool quit = false;
+
+		uint32_t pending = 0;
+		std::condition_variable done_cv;
+	} shared;
+	std::vector< std::thread > workers;
+	std::ostream *log; //where progress messages go
+
+	JobQueue(uint32_t max_threads, std::ostream &log_ = std::cout) : log(&log_) {
+		unsigned int n = std::thread::hardware_concurrency();
+		if (max_threads != 0) n = std::min(n, max_threads);
+		*log << "Spawning " << n << " worker threads." << std::endl;
+		workers.reserve(n);
+		for (unsigned int i = 0; i < n; ++i) {
+			//making a non-member-variable pointer to copy to thread:
+			workers.emplace_back(worker_main, &shared);
+		}
+	}
+	~JobQueue() {
+		*log << " Waiting for worker threads to exit..."; log->flush();
+		{
+			std::lock_guard< std::mutex > lock(shared.mutex);
+			shared.queue.clear();
+			shared.quit = true;
+			shared.cv.notify_all();
+		}
+		for (auto &worker : workers) {
+			worker.join();
+		}
+		*log << " done." << std::endl;
+	}
+
+	void run(std::function< void() > const &fn) {
+		std::lock_guard< std::mutex > lock(shared.mutex);
+		shared.queue.emplace_back(fn);
+		shared.cv.notify_one();
+	}
+	void wait() {
+		std::unique_lock< std::mutex > lock(shared.mutex);
+		while (!(shared.queue.empty() && shared.pending == 0)) {
+			shared.done_cv.wait(lock);
+		}
+	}
+
+	static void worker_main(Shared *shared_) {
+		Shared &shared = *shared_;
+
+		std::unique_lock< std::mutex > lock(shared.mutex);
+		while (!shared.quit) {
+			if (shared.queue.empty()) {
+				shared.cv.wait(lock);
+			} else {
+				std::function< void() > fn = std::move(shared.queue.front());
+				shared.queue.pop_front();
+				shared.pending += 1;
+				lock.unlock();
+
+				fn();
+
+				lock.lock();
+				shared.pending -= 1;
+				shared.done_cv.notify_all();
+			}
+		}
+	}
+
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "dither.hpp"
+
+#include <vector>
+#include <span>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+//transition tables between States, built once per (yarns, use_within, cross_within) and used by optimal_dither:
+
+constexpr uint32_t YARN_SHIFT = 27;
+constexpr uint32_t STATE_MASK = 0x07ffffff;
+static_assert(~(31u << YARN_SHIFT) == STATE_MASK, "Yarn shift avoids state mask perfectly.");
+
+//Transitions only depend on the column through the "never used yet" / "never crossed yet" checks,
+// so every column shares one automaton; columns during the warm-up at the start of a row just can't reach all of its states.
+struct Tables {
+	//every state that can appear before any column;
+	// the first 'steady_states' of these are exactly the states that can appear before every column from 'warmup' on:
+	std::vector< State > states;
+	uint32_t steady_states = 0;
+	uint32_t warmup = 0;
+
+	//"pull"-style propagation from the previous column:
+	// (these point into Tables::storage or into a memory-mapped cache file)
+	std::span< uint32_t const > first_from; //first index to read from for each state
+	std::span< uint32_t const > steady_froms_end; //end of the froms that come from steady states, for each steady state
+	std::span< uint32_t const > froms; //(yarn index << YARN_SHIFT) | (prev state index); ascending for each state, so froms from steady states come first
+
+	//reachable[x] (for x < warmup) is a bitmask of the states that can appear before column x:
+	// (so a transition is used at column x if its 'from' is reachable at x and its 'to' is reachable at x+1)
+	std::vector< std::span< uint64_t const > > reachable;
+
+	//is column x past the warm-up?
+	bool steady(uint32_t x) const { return x >= warmup; }
+	//states that might appear before column x are all in [0, column_states(x)):
+	uint32_t column_states(uint32_t x) const { return steady(x) ? steady_states : uint32_t(states.size()); }
+	//can state s appear before column x?
+	bool is_reachable(uint32_t x, uint32_t s) const {
+		if (steady(x)) return s < steady_states;
+		return (reachable[x][s / 64] >> (s % 64)) & 1;
+	}
+	//froms of state 'to' that are used when stepping from column x to column x+1 are [first_from[to], froms_end(x, to)):
+	uint32_t froms_end(uint32_t x, uint32_t to) const {
+		return steady(x) ? steady_froms_end[to] : first_from[to+1];
+	}
+
+	//optional compact copy of froms, built by pack_froms:
+	// every from of a state uses the same yarn (the one it just used), to_yarn[to];
+	// the from indices are stored as varint-encoded deltas (see read_varint) starting at packed_froms[first_packed[to]]
+	std::vector< uint8_t > to_yarn;
+	std::vector< uint32_t > first_packed;
+	std::vector< uint8_t > packed_froms;
+	bool packed() const { return !first_packed.empty(); }
+
+	//optional dominance relation, built by build_dominance:
+	// state a dominates state b if every way of finishing the row from b also works from a (with the same yarns, so at the same cost);
+	// so a state at some column can be dropped if a state that dominates it is no more expensive.
+	// dominators[first_dominator[b]] .. dominators[first_dominator[b+1]-1] are the states that dominate b by one step,
+	// and dominance_order lists every state after all of its dominators (dominance is transitive, so chains of these find most of the rest)
+	std::vector< uint32_t > first_dominator;
+	std::vector< uint32_t > dominators;
+	std::vector< uint32_t > dominance_order;
+	bool has_dominance() const { return !first_dominator.empty(); }
+
+	//backing storage for freshly-built tables:
+	std::vector< std::vector< uint32_t > > storage;
+	std::vector< std::vector< uint64_t > > mask_storage;
+
+	//backing storage for tables loaded from a cache file:
+	struct Mapping {
+		Mapping(void *data, size_t size) : data(data), size(size) { }
+		~Mapping();
+		Mapping(Mapping const &) = delete;
+		Mapping &operator=(Mapping const &) = delete;
+		void *data;
+		size_t size;
+	};
+	std::unique_ptr< Mapping > mapping;
+};
+
+//read a varint (7 bits per byte, low bits first, high bit set on all but the last byte) and advance *at past it:
+inline uint32_t read_varint(uint8_t const **at) {
+	uint32_t value = 0;
+	for (uint32_t shift = 0; ; shift += 7) {
+		uint8_t byte = *((*at)++);
+		value |= uint32_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+}
+
+struct JobQueue;
+
+//build tables for the first 'columns' columns (stops early if the reachable states converge):
+// if job_queue is not null, large expansions are done in parallel (with the same indices as a serial build)
+Tables build_tables(DitherParams const &params, uint32_t columns, JobQueue *job_queue);
+
+//read/write a table cache file (for the yarn count, use_within, and cross_within in params):
+// load returns false (and leaves *tables unchanged) if the file is missing, damaged, or for different parameters
+// save returns false (after printing a warning) if the file couldn't be written
+bool load_tables(std::string const &filename, DitherParams const &params, Tables *tables);
+bool save_tables(std::string const &filename, DitherParams const &params, Tables const &tables);
+
+//fill in the packed_froms copy of tables->froms:
+void pack_froms(Tables *tables);
+
+//make a "push"-style copy of tables.froms:
+// (*tos)[(*first_to)[s]] .. (*tos)[(*first_to)[s+1]-1] are (yarn << YARN_SHIFT) | (next state index), ascending for each state
+void push_transitions(Tables const &tables, std::vector< uint32_t > *first_to, std::vector< uint32_t > *tos);
+
+//fill in the dominance relation between tables->states (for params.use_within and params.cross_within):
+void build_dominance(Tables *tables, DitherParams const &params);
+
+//get tables for params.image_width columns, using the cache in params.table_cache (if set):
+Tables get_tables(DitherParams const &params, JobQueue *job_queue);
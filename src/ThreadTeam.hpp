@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//persistent team of threads that work in lock-step (unlike JobQueue, there is no queue and no mutex):
+// run(fn) calls fn(member) on every member of the team -- the calling thread is member 0 -- and returns when all are done;
+// inside fn, barrier() waits until every member has reached it (so members can step through columns together).
+struct ThreadTeam {
+	//(progress messages go to 'log')
+	ThreadTeam(uint32_t max_threads, std::ostream &log = std::cout) {
+		//cores this process may run on (taskset or cgroup limits can make these fewer than the machine has):
+		std::vector< uint32_t > cpus = allowed_cpus();
+		unsigned int cores = (cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : uint32_t(cpus.size()));
+		//only spin (and pin) if every member can have a core to itself:
+		spin = (max_threads == 0 || max_threads <= cores);
+		unsigned int n = cores;
+		if (max_threads != 0) n = std::min(n, max_threads);
+		log << "Spawning a team of " << n << " threads (including this one)." << std::endl;
+		//member i is pinned to the i-th allowed cpu (the calling thread gets its old affinity back when the team is done):
+		bool const pin_members = (spin && !cpus.empty());
+		#ifdef __linux__
+		if (pin_members && pthread_getaffinity_np(pthread_self(), sizeof(caller_affinity), &caller_affinity) == 0) {
+			caller_pinned = true;
+			pin(pthread_self(), cpus[0]);
+		}
+		#endif
+		workers.reserve(n - 1);
+		for (unsigned int member = 1; member < n; ++member) {
+			workers.emplace_back(&ThreadTeam::worker_main, this, member);
+			if (pin_members) pin(workers.back().native_handle(), cpus[member]);
+		}
+	}
+	~ThreadTeam() {
+		quit = true;
+		job_generation.fetch_add(1, std::memory_order_release);
+		job_generation.notify_all();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+		#ifdef __linux__
+		if (caller_pinned) pthread_setaffinity_np(pthread_self(), sizeof(caller_affinity), &caller_affinity);
+		#endif
+	}
+	ThreadTeam(ThreadTeam const &) = delete;
+	ThreadTeam &operator=(ThreadTeam const &) = delete;
+
+	uint32_t size() const { return uint32_t(workers.size()) + 1; }
+
+	void run(std::function< void(uint32_t) > const &fn_) {
+		fn = &fn_;
+		job_generation.fetch_add(1, std::memory_order_release);
+		job_generation.notify_all();
+		fn_(0);
+		barrier();
+		fn = nullptr;
+	}
+
+	//sense-reversing barrier: the last member to arrive resets the count and starts the next generation:
+	void barrier() {
+		uint32_t generation = barrier_generation.load(std::memory_order_acquire);
+		if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == size()) {
+			arrived.store(0, std::memory_order_relaxed);
+			barrier_generation.fetch_add(1, std::memory_order_release);
+			barrier_generation.notify_all();
+		} else {
+			wait_for_change(barrier_generation, generation);
+		}
+	}
+
+	std::vector< std::thread > workers;
+	std::function< void(uint32_t) > const *fn = nullptr;
+	std::atomic< uint32_t > job_generation{0};
+	std::atomic< uint32_t > barrier_generation{0};
+	std::atomic< uint32_t > arrived{0};
+	std::atomic< bool > quit{false};
+	bool spin = true;
+
+	//spin for a little while (cheap when the others are about to arrive), then sleep (via futex on linux):
+	void wait_for_change(std::atomic< uint32_t > const &value, uint32_t old) const {
+		if (spin) {
+			for (uint32_t iter = 0; iter < 4000; ++iter) {
+				if (value.load(std::memory_order_acquire) != old) return;
+				#if defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+				#endif
+			}
+		}
+		while (value.load(std::memory_order_acquire) == old) {
+			value.wait(old, std::memory_order_acquire);
+		}
+	}
+
+	void worker_main(uint32_t member) {
+		uint32_t seen = 0;
+		while (true) {
+			wait_for_change(job_generation, seen);
+			seen = job_generation.load(std::memory_order_acquire);
+			if (quit) break;
+			(*fn)(member);
+			barrier();
+		}
+	}
+
+	#ifdef __linux__
+	cpu_set_t caller_affinity;
+	#endif
+	bool caller_pinned = false;
+
+	//cpus in this process's affinity mask, in order (empty if it can't be read):
+	static std::vector< uint32_t > allowed_cpus() {
+		std::vector< uint32_t > cpus;
+		#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &set)) cpus.emplace_back(cpu);
+			}
+		}
+		#endif
+		return cpus;
+	}
+
+	static void pin(std::thread::native_handle_type thread, uint32_t cpu) {
+		#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(thread, sizeof(set), &set);
+		#else
+		(void)thread;
+		(void)cpu;
+		#endif
+	}
+};
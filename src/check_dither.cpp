@@ -0,0 +1,59 @@
+#include "dither.hpp"
+#include "JobQueue.hpp"
+
+#include <cassert>
+#include <algorithm>
+
+DitherWindows dither_windows(uint32_t yarns, uint8_t const *row, uint32_t image_width) {
+	DitherWindows windows;
+
+	//windows are measured for every starting column x, right to left, keeping track of:
+	// next_use[y] -- the first column >= x that uses yarn y (image_width if none)
+	// next_crossing -- the first column >= x that completes a crossing whose first use is also >= x (image_width if none)
+	std::vector< uint32_t > next_use(yarns, image_width);
+	uint32_t next_crossing = image_width;
+
+	for (uint32_t x = image_width; x-- > 0; ) {
+		uint8_t y = row[x];
+		assert(y < yarns);
+		//a crossing starting at x completes at the next use of the same yarn (if an odd number of columns away):
+		if (next_use[y] != image_width && (next_use[y] - x) % 2 != 0) {
+			next_crossing = std::min(next_crossing, next_use[y]);
+		}
+		next_use[y] = x;
+
+		//the window starting at x first contains every yarn once it reaches the last of their next uses:
+		uint32_t all_used = *std::max_element(next_use.begin(), next_use.end());
+		windows.longest_no_use = std::max(windows.longest_no_use, all_used - x);
+		windows.longest_no_crossing = std::max(windows.longest_no_crossing, next_crossing - x);
+	}
+
+	return windows;
+}
+
+DitherWindows dither_windows(uint32_t yarns, std::vector< uint8_t > const &dithered, uint32_t image_width, uint32_t image_height, uint32_t max_threads) {
+	assert(dithered.size() == size_t(image_width) * image_height);
+
+	std::vector< DitherWindows > row_windows(image_height);
+	{
+		JobQueue job_queue(max_threads);
+		//(a few rows per job, so small images don't drown in job overhead)
+		uint32_t const rows_per_job = std::max< uint32_t >(1, 65536 / std::max< uint32_t >(1, image_width));
+		for (uint32_t begin = 0; begin < image_height; begin += rows_per_job) {
+			uint32_t end = std::min(image_height, begin + rows_per_job);
+			job_queue.run([&,begin,end](){
+				for (uint32_t row = begin; row < end; ++row) {
+					row_windows[row] = dither_windows(yarns, dithered.data() + size_t(row) * image_width, image_width);
+				}
+			});
+		}
+		job_queue.wait();
+	}
+
+	DitherWindows windows;
+	for (DitherWindows const &w : row_windows) {
+		windows.longest_no_use = std::max(windows.longest_no_use, w.longest_no_use);
+		windows.longest_no_crossing = std::max(windows.longest_no_crossing, w.longest_no_crossing);
+	}
+	return windows;
+}
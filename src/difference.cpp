@@ -0,0 +1,178 @@
+#include "Cost.hpp"
+#include "dither.hpp"
+
+#include <array>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//batched versions of the difference functions in Cost.hpp
+// these must give *exactly* the same values as the one-pair-at-a-time versions (the optimal dither asserts that its
+// path costs add up), so every SIMD step below does the same float operations in the same order as the scalar code;
+// the transcendental parts (cbrtf and pow) are left to the scalar library functions for the same reason.
+
+namespace {
+
+//fallback: call the difference on every pair
+struct GenericBatch : DifferenceBatch {
+	GenericBatch(Difference const &difference_, std::vector< Color::Linear > const &yarns_) : difference(difference_), yarns(yarns_) { }
+	virtual void operator()(Color::Linear const *pixels, uint32_t count, Cost *costs) const override {
+		for (uint32_t i = 0; i < count; ++i) {
+			for (uint32_t y = 0; y < yarns.size(); ++y) {
+				costs[i * yarns.size() + y] = difference(pixels[i], yarns[y]);
+			}
+		}
+	}
+	Difference const &difference;
+	std::vector< Color::Linear > yarns;
+};
+
+//differences that are squared distances after transforming both colors into some space:
+// Space::one(c, xyz) transforms one color; Space::four(c, x, y, z) transforms four at once (as SIMD lanes)
+template< typename Space >
+struct SquaredDistanceBatch : DifferenceBatch {
+	SquaredDistanceBatch(std::vector< Color::Linear > const &yarns) {
+		//yarn colors are only transformed once:
+		yarn_xyz.reserve(yarns.size());
+		for (Color::Linear const &yarn : yarns) {
+			std::array< float, 3 > xyz;
+			Space::one(yarn, xyz.data());
+			yarn_xyz.emplace_back(xyz);
+		}
+	}
+	virtual void operator()(Color::Linear const *pixels, uint32_t count, Cost *costs) const override {
+		with_yarn_count(yarn_xyz.size(), [&](auto Yarns) {
+			fill< decltype(Yarns)::value >(pixels, count, costs);
+		});
+	}
+	//(with the yarn loops unrolled for 'Yarns' yarns, if Yarns != 0)
+	template< uint32_t Yarns >
+	void fill(Color::Linear const *pixels, uint32_t count, Cost *costs) const {
+		uint32_t const yarns = (Yarns != 0 ? Yarns : yarn_xyz.size());
+		uint32_t i = 0;
+		#if defined(__SSE2__)
+		for (; i + 4 <= count; i += 4) {
+			__m128 px, py, pz;
+			Space::four(pixels + i, &px, &py, &pz);
+			for (uint32_t y = 0; y < yarns; ++y) {
+				__m128 dx = _mm_sub_ps(px, _mm_set1_ps(yarn_xyz[y][0]));
+				__m128 dy = _mm_sub_ps(py, _mm_set1_ps(yarn_xyz[y][1]));
+				__m128 dz = _mm_sub_ps(pz, _mm_set1_ps(yarn_xyz[y][2]));
+				__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+				alignas(16) float lanes[4];
+				_mm_store_ps(lanes, d2);
+				for (uint32_t l = 0; l < 4; ++l) {
+					costs[(i + l) * yarns + y] = lanes[l];
+				}
+			}
+		}
+		#endif
+		for (; i < count; ++i) {
+			float p[3];
+			Space::one(pixels[i], p);
+			for (uint32_t y = 0; y < yarns; ++y) {
+				costs[i * yarns + y] = (p[0]-yarn_xyz[y][0])*(p[0]-yarn_xyz[y][0])
+				                     + (p[1]-yarn_xyz[y][1])*(p[1]-yarn_xyz[y][1])
+				                     + (p[2]-yarn_xyz[y][2])*(p[2]-yarn_xyz[y][2]);
+			}
+		}
+	}
+	std::vector< std::array< float, 3 > > yarn_xyz;
+};
+
+#if defined(__SSE2__)
+//load one component of four colors as SIMD lanes:
+inline __m128 gather(float const *c0, float const *c1, float const *c2, float const *c3) {
+	return _mm_set_ps(*c3, *c2, *c1, *c0);
+}
+#endif
+
+struct LinearSpace {
+	static void one(Color::Linear const &c, float *xyz) {
+		xyz[0] = c.r;
+		xyz[1] = c.g;
+		xyz[2] = c.b;
+	}
+	#if defined(__SSE2__)
+	static void four(Color::Linear const *c, __m128 *x, __m128 *y, __m128 *z) {
+		*x = gather(&c[0].r, &c[1].r, &c[2].r, &c[3].r);
+		*y = gather(&c[0].g, &c[1].g, &c[2].g, &c[3].g);
+		*z = gather(&c[0].b, &c[1].b, &c[2].b, &c[3].b);
+	}
+	#endif
+};
+
+struct SRGBSpace {
+	static void one(Color::Linear const &c, float *xyz) {
+		c.to_srgb_clamped(&xyz[0], &xyz[1], &xyz[2]);
+	}
+	#if defined(__SSE2__)
+	static void four(Color::Linear const *c, __m128 *x, __m128 *y, __m128 *z) {
+		float xyz[4][3];
+		for (uint32_t l = 0; l < 4; ++l) {
+			one(c[l], xyz[l]);
+		}
+		*x = gather(&xyz[0][0], &xyz[1][0], &xyz[2][0], &xyz[3][0]);
+		*y = gather(&xyz[0][1], &xyz[1][1], &xyz[2][1], &xyz[3][1]);
+		*z = gather(&xyz[0][2], &xyz[1][2], &xyz[2][2], &xyz[3][2]);
+	}
+	#endif
+};
+
+struct OKLabSpace {
+	static void one(Color::Linear const &c, float *xyz) {
+		Color::OKLab lab = Color::OKLab::from_linear(c);
+		xyz[0] = lab.L;
+		xyz[1] = lab.a;
+		xyz[2] = lab.b;
+	}
+	#if defined(__SSE2__)
+	//same steps as Color::OKLab::from_linear:
+	static void four(Color::Linear const *c, __m128 *x, __m128 *y, __m128 *z) {
+		__m128 r, g, b;
+		LinearSpace::four(c, &r, &g, &b);
+
+		auto mad3 = [](float A, __m128 a, float B, __m128 b, float C, __m128 c) {
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(A), a), _mm_mul_ps(_mm_set1_ps(B), b)), _mm_mul_ps(_mm_set1_ps(C), c));
+		};
+		__m128 l = mad3(0.4122214708f, r, 0.5363325363f, g, 0.0514459929f, b);
+		__m128 m = mad3(0.2119034982f, r, 0.6806995451f, g, 0.1073969566f, b);
+		__m128 s = mad3(0.0883024619f, r, 0.2817188376f, g, 0.6299787005f, b);
+
+		alignas(16) float lms[3][4];
+		_mm_store_ps(lms[0], l);
+		_mm_store_ps(lms[1], m);
+		_mm_store_ps(lms[2], s);
+		for (auto &row : lms) {
+			for (float &v : row) v = cbrtf(v);
+		}
+		__m128 l_ = _mm_load_ps(lms[0]);
+		__m128 m_ = _mm_load_ps(lms[1]);
+		__m128 s_ = _mm_load_ps(lms[2]);
+
+		auto term = [](float A, __m128 a) { return _mm_mul_ps(_mm_set1_ps(A), a); };
+		*x = _mm_sub_ps(_mm_add_ps(term(0.2104542553f, l_), term(0.7936177850f, m_)), term(0.0040720468f, s_));
+		*y = _mm_add_ps(_mm_sub_ps(term(1.9779984951f, l_), term(2.4285922050f, m_)), term(0.4505937099f, s_));
+		*z = _mm_sub_ps(_mm_add_ps(term(0.0259040371f, l_), term(0.7827717662f, m_)), term(0.8086757660f, s_));
+	}
+	#endif
+};
+
+} //namespace
+
+std::unique_ptr< DifferenceBatch > Difference::batch(std::vector< Color::Linear > const &yarns) const {
+	return std::make_unique< GenericBatch >(*this, yarns);
+}
+
+std::unique_ptr< DifferenceBatch > SRGBDifference::batch(std::vector< Color::Linear > const &yarns) const {
+	return std::make_unique< SquaredDistanceBatch< SRGBSpace > >(yarns);
+}
+
+std::unique_ptr< DifferenceBatch > LinearDifference::batch(std::vector< Color::Linear > const &yarns) const {
+	return std::make_unique< SquaredDistanceBatch< LinearSpace > >(yarns);
+}
+
+std::unique_ptr< DifferenceBatch > OKLabDifference::batch(std::vector< Color::Linear > const &yarns) const {
+	return std::make_unique< SquaredDistanceBatch< OKLabSpace > >(yarns);
+}
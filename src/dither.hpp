@@ -6,7 +6,12 @@
 #include <vector>
 #include <cstdint>
 #include <iostream>
-#include <functional>
+#include <string>
+#include <array>
+#include <bit>
+#include <type_traits>
+
+struct Tables;
 
 struct DitherParams {
 	std::vector< Color::Linear > const &yarns_linear;
@@ -24,6 +29,21 @@ struct DitherParams {
 	uint32_t seed = 0; //was: 3141926265u; //seed for pseudo-random stream; '0' is special value meaning "just pick the first one"
 
 	uint32_t max_threads = 0; //maximum number of compute threads to use; '0' means automatically pick (probably based on max core count).
+	std::string threading = "team"; //how the optimal dither splits each column over threads: 'team' (persistent threads + barrier, see ThreadTeam.hpp) or 'queue' (jobs on a JobQueue)
+
+	std::string table_cache = ""; //directory to keep transition tables in between runs; '' means don't cache
+
+	bool packed_froms = false; //have the optimal dither read transitions from a varint-packed copy of the tables (less memory traffic, more decoding)
+	bool backpointers = false; //have the optimal dither remember where each state's min cost came from (more memory, but readback only rescans on ties)
+	std::string pull_kernel = "auto"; //version of the optimal dither's inner loop (see pull_costs.hpp); 'auto' picks the fastest one the CPU supports
+	uint32_t memory_budget = 0; //MB the optimal dither may use for its per-row cost storage (past that it stores checkpoints and re-computes); '0' means no limit
+	uint32_t beam_width = 100; //the greedy dither makes passes over a row until this many states reach its end
+	uint32_t beam_block = 200; //the greedy dither expands this many of the lowest-cost states at each column on each pass
+	std::string search = "dp"; //how the optimal dither finds each row's cheapest cost: 'dp' (a forward pass over every state at every column) or 'astar' (best-first, with a lower bound on the rest of the row; same output)
+	uint32_t search_limit = 0; //(state, column) pairs 'astar' may visit in a row before it gives up and does the forward pass instead; '0' means 1/1000th of the pairs the forward pass visits (or a few per column, if more); after a few rows in a row give up, the rest of the image isn't searched
+	bool prune_dominated = false; //have the greedy dither drop states that another, no more expensive state at the same column dominates (see build_dominance in Tables.hpp); the optimal dither ignores this
+	std::ostream *log = &std::cout; //where the dithers (and the tables and threads they make) write progress messages; errors still go to std::cerr
+	Tables const *tables = nullptr; //transition tables for the dithers to use (already packed, if packed_froms is set, and with dominance, if prune_dominated is set); 'nullptr' means build or load them
 };
 
 //returns yarn indices array of same size as input image.
@@ -36,22 +56,165 @@ std::vector< uint8_t > greedy_dither(DitherParams const &params);
 // (or, if params.diffuse == false, this does nothing)
 void error_diffusion(DitherParams const &params, uint32_t row, std::vector< uint8_t > const &dithered, std::vector< Color::Linear > *image_linear);
 
+//helper used to check dithers (by knit-dither, and by both dithers themselves in debug builds):
+// finds the longest window in any row that doesn't use every yarn, and the longest that doesn't contain a crossing
+// (a yarn's use followed by its next use an odd number of columns later); use_within / cross_within hold if these are shorter.
+// rows are split over up to max_threads threads (0 == all cores); each row takes O(width * yarns) time.
+struct DitherWindows {
+	uint32_t longest_no_use = 0;
+	uint32_t longest_no_crossing = 0;
+};
+DitherWindows dither_windows(uint32_t yarns, uint8_t const *row, uint32_t image_width); //one row
+DitherWindows dither_windows(uint32_t yarns, std::vector< uint8_t > const &dithered, uint32_t image_width, uint32_t image_height, uint32_t max_threads);
+
 
 //---------------------------------------
 //moving State up here so it can be shared by both optimal and greedy dither approaches:
 
+//helpers for doing byte-wise math on eight uint8_t counters packed into a uint64_t ("SIMD within a register"):
+// (like the image code, this assumes a little-endian machine -- counter i is bits [8i, 8i+8) of the word)
+namespace SWAR {
+	constexpr uint64_t Ones = 0x0101010101010101ull;
+	constexpr uint64_t High = 0x8080808080808080ull;
+
+	inline constexpr uint64_t broadcast(uint8_t v) { return Ones * v; }
+	//0x01 in each nonzero byte, 0x00 elsewhere:
+	inline constexpr uint64_t nonzero(uint64_t x) { return ((((x & ~High) + ~High) | x) & High) >> 7; }
+	//0x80 in each byte where x >= y (unsigned), 0x00 elsewhere:
+	inline constexpr uint64_t ge(uint64_t x, uint64_t y) {
+		uint64_t d = (x | High) - (y & ~High); //high bit of each byte is (low 7 bits of x >= low 7 bits of y); no borrows between bytes
+		return ((x & ~y) | (~(x ^ y) & d)) & High;
+	}
+	//0xff in each byte with its high bit set, 0x00 elsewhere:
+	inline constexpr uint64_t expand(uint64_t high) { return (high >> 7) * 0xff; }
+	//0xff in the first 'count' bytes of a pair of words:
+	inline constexpr std::array< uint64_t, 2 > first_bytes(uint32_t count) {
+		return {
+			(count >= 8 ? ~0ull : (1ull << (8 * count)) - 1),
+			(count >= 16 ? ~0ull : count <= 8 ? 0ull : (1ull << (8 * (count - 8))) - 1)
+		};
+	}
+}
+static_assert(std::endian::native == std::endian::little, "SWAR counters assume a little-endian machine.");
+
+//yarn counts with their own compiled versions of the State operations (and of the loops that use them);
+// code templated on 'Yarns' uses Yarns == 0 for the generic version, which reads the count from the state:
+constexpr uint32_t MinSpecializedYarns = 2;
+constexpr uint32_t MaxSpecializedYarns = 8;
+
+//call f(std::integral_constant< uint32_t, Yarns >()) with Yarns == yarns if that count is specialized, or Yarns == 0 if not:
+template< typename F >
+decltype(auto) with_yarn_count(uint32_t yarns, F &&f) {
+	static_assert(MinSpecializedYarns == 2 && MaxSpecializedYarns == 8, "with_yarn_count cases match the specialized range.");
+	switch (yarns) {
+		case 2: return f(std::integral_constant< uint32_t, 2 >());
+		case 3: return f(std::integral_constant< uint32_t, 3 >());
+		case 4: return f(std::integral_constant< uint32_t, 4 >());
+		case 5: return f(std::integral_constant< uint32_t, 5 >());
+		case 6: return f(std::integral_constant< uint32_t, 6 >());
+		case 7: return f(std::integral_constant< uint32_t, 7 >());
+		case 8: return f(std::integral_constant< uint32_t, 8 >());
+		default: return f(std::integral_constant< uint32_t, 0 >());
+	}
+}
+
 //Relevant path information just after a stitch is placed:
 struct State {
-	State(size_t yarns_) : last_used(yarns_, 0) { }
-	std::vector< uint8_t > last_used; //how many stitches since this yarn was last used (if one, yarn was just used; if use_within, state is a dead end; zero is a special value indicating yarn has never been used)
+	static constexpr uint32_t MaxYarns = 16;
+
+	State(size_t yarns_) {
+		assert(yarns_ <= MaxYarns);
+		last_used.count = yarns_;
+	}
+
+	//how many stitches since this yarn was last used (if one, yarn was just used; if use_within, state is a dead end; zero is a special value indicating yarn has never been used)
+	// stored inline, one byte per yarn, so successors can be computed two 64-bit words at a time:
+	struct LastUsed {
+		alignas(8) std::array< uint8_t, MaxYarns > lanes{}; //lanes past 'count' are always zero
+		uint8_t count = 0;
+
+		size_t size() const { return count; }
+		uint8_t &operator[](size_t y) { assert(y < count); return lanes[y]; }
+		uint8_t const &operator[](size_t y) const { assert(y < count); return lanes[y]; }
+		uint8_t *begin() { return lanes.data(); }
+		uint8_t *end() { return lanes.data() + count; }
+		uint8_t const *begin() const { return lanes.data(); }
+		uint8_t const *end() const { return lanes.data() + count; }
+
+		std::array< uint64_t, 2 > words() const { return std::bit_cast< std::array< uint64_t, 2 > >(lanes); }
+		void set_words(std::array< uint64_t, 2 > const &words) { lanes = std::bit_cast< std::array< uint8_t, MaxYarns > >(words); }
+
+		bool operator==(LastUsed const &) const = default;
+		//(unused lanes are zero, so this orders the same way comparing the first 'count' lanes would:)
+		bool operator<(LastUsed const &o) const { return lanes < o.lanes; }
+	} last_used;
 	uint8_t last_cross = 0; //how many stitches since the most recent crossing started (if zero, no crossing has happened yet; otherwise will be >= 2 since you can't have a crossing in just one stitch worth of space!
 	bool operator==(State const &) const = default;
 	bool operator<(State const &o) const {
 		if (last_used != o.last_used) return last_used < o.last_used;
 		else return last_cross < o.last_cross;
 	}
-	//call a callback on all valid successor states to this state, after filling a stitch at column 'x' of the row:
-	void next_states(DitherParams const &params, uint32_t x, std::function< void( uint32_t, State const & ) > const &cb) const {
+	//number of yarns (known at compile time if Yarns != 0):
+	template< uint32_t Yarns = 0 >
+	uint32_t yarns() const {
+		if constexpr (Yarns != 0) {
+			assert(last_used.size() == Yarns);
+			return Yarns;
+		} else {
+			return last_used.size();
+		}
+	}
+
+	//call a callback (as cb(y, next_state)) on all valid successor states to this state, after filling a stitch at column 'x' of the row:
+	template< uint32_t Yarns = 0, typename Callback >
+	void next_states(DitherParams const &params, uint32_t x, Callback &&cb) const {
+		uint32_t bad_count, bad_yarn;
+		State const base = advanced< Yarns >(params, x, &bad_count, &bad_yarn);
+		if (bad_count > 1) return; //can't use more than one yarn at once, so no successors
+
+		for (uint8_t y = 0; y < yarns< Yarns >(); ++y) {
+			if (bad_count == 1 && y != bad_yarn) continue;
+
+			State next_state = base;
+			if (next_state.use(params, x, y)) {
+				cb( y, next_state );
+			}
+		}
+	}
+
+	//compute the successor state from using yarn 'y' at column 'x' of the row; returns false if that successor isn't valid:
+	template< uint32_t Yarns = 0 >
+	bool next_state(DitherParams const &params, uint32_t x, uint32_t y, State *next_state_) const {
+		assert(next_state_);
+		assert(y < yarns< Yarns >());
+		uint32_t bad_count, bad_yarn;
+		State next_state = advanced< Yarns >(params, x, &bad_count, &bad_yarn);
+		if (bad_count > 1 || (bad_count == 1 && y != bad_yarn)) return false;
+		if (!next_state.use(params, x, y)) return false;
+		*next_state_ = next_state;
+		return true;
+	}
+
+	//the yarn used to arrive in this state (the one with last_used == 1), or -1U for the row's initial state:
+	template< uint32_t Yarns = 0 >
+	uint32_t used_yarn() const {
+		std::array< uint64_t, 2 > words = last_used.words();
+		for (uint32_t i = 0; i < Words< Yarns >; ++i) {
+			uint64_t ones = (SWAR::nonzero(words[i] ^ SWAR::Ones) ^ SWAR::Ones) << 7; //(unused lanes are zero, so never match)
+			if (ones != 0) return 8 * i + std::countr_zero(ones) / 8;
+		}
+		return -1U;
+	}
+
+private:
+	//packed words that can hold nonzero counters (unused lanes are always zero):
+	template< uint32_t Yarns >
+	static constexpr uint32_t Words = (Yarns == 0 ? 2 : (Yarns + 7) / 8);
+
+	//move state forward over column 'x' (this part is the same no matter which yarn is used),
+	// and count the yarns that would make the next state invalid unless they are the one used now:
+	template< uint32_t Yarns >
+	State advanced(DitherParams const &params, uint32_t x, uint32_t *bad_count_, uint32_t *bad_yarn_) const {
 		uint32_t use_within = params.use_within;
 		uint32_t cross_within = params.cross_within;
 
@@ -59,71 +222,84 @@ struct State {
 		assert(cross_within == 0 || (last_cross <= cross_within && last_cross != 1)); //if cross_within is enabled, last_cross should either be zero (at start of row) or >= 2 and <= cross_within
 		assert(cross_within != 0 || last_cross == 0); //if cross_within disabled, last_cross should be zero, always
 
-		for (uint8_t y = 0; y < last_used.size(); ++y) {
-			//move state forward:
-			State next_state = *this;
-			if (cross_within != 0) {
-				if (next_state.last_cross != 0) {
-					next_state.last_cross += 1;
-					assert(next_state.last_cross > 0); //no overflow, please!
-				}
+		State base = *this;
+		if (cross_within != 0) {
+			if (base.last_cross != 0) {
+				base.last_cross += 1;
+				assert(base.last_cross > 0); //no overflow, please!
 			}
+		}
 
-			for (auto &last_used : next_state.last_used) {
-				if (last_used == 0) continue;
-				last_used += 1;
-				if (use_within == 0) {
-					if (cross_within == 0) {
-						//if crossing tracking also disabled, all we need to know is that yarn was used (and if it was most-recently used):
-						last_used = 2;
-					} else {
-						//if crossing tracking is enabled, need to know how long since yarn was used until after it exceeds cross_within:
-						if (last_used > cross_within + 1) last_used = cross_within + 1;
-					}
+		std::array< uint64_t, 2 > words = base.last_used.words();
+		for (uint32_t i = 0; i < Words< Yarns >; ++i) {
+			uint64_t &w = words[i];
+			assert(SWAR::ge(w, SWAR::broadcast(0xff)) == 0); //no overflow, please!
+			w += SWAR::nonzero(w); //(used yarns count up; unused yarns stay zero)
+			if (use_within == 0) {
+				if (cross_within == 0) {
+					//if crossing tracking also disabled, all we need to know is that yarn was used (and if it was most-recently used):
+					w = SWAR::nonzero(w) * 2;
+				} else if (cross_within + 1 <= 0xff) {
+					//if crossing tracking is enabled, need to know how long since yarn was used until after it exceeds cross_within:
+					uint64_t limit = SWAR::broadcast(cross_within + 1);
+					uint64_t over = SWAR::expand(SWAR::ge(w, limit));
+					w = (w & ~over) | (limit & over);
 				}
-				assert(last_used != 0); //no overflow, please!
 			}
+		}
+		base.last_used.set_words(words);
 
-			//use the yarn:
-
-			//update for crossings:
-			if (cross_within != 0 //cross_within must be enabled
-			 && next_state.last_used[y] != 0 //yarn must have been used
-			 && next_state.last_used[y] % 2 == 0) { //and yarn must have been used an even number of steps ago (since it's about to be used an odd number of steps ago)
-			 	//if there is no last crossing, or the last crossing was before this crossing, update it:
-				if (next_state.last_cross == 0 || next_state.last_cross > next_state.last_used[y]) {
-					next_state.last_cross = next_state.last_used[y];
+		uint32_t &bad_count = *bad_count_;
+		uint32_t &bad_yarn = *bad_yarn_;
+		bad_count = 0;
+		bad_yarn = -1U;
+		if (use_within != 0) {
+			std::array< uint64_t, 2 > lanes = SWAR::first_bytes(yarns< Yarns >());
+			for (uint32_t i = 0; i < Words< Yarns >; ++i) {
+				uint64_t bad = 0;
+				//used longer ago than use_within:
+				if (use_within + 1 <= 0xff) bad |= SWAR::ge(words[i], SWAR::broadcast(use_within + 1));
+				//if not used yet, then treat as if yarn was last used just left of x=0:
+				// i.e., moving over x=0, state would have last_used=1, so next_state should have last_used=2
+				if (x + 2 > use_within) bad |= (SWAR::nonzero(words[i]) ^ SWAR::Ones) << 7;
+				bad &= lanes[i];
+				if (bad != 0) {
+					bad_count += std::popcount(bad);
+					bad_yarn = 8 * i + std::countr_zero(bad) / 8;
 				}
 			}
-			//mark the yarn used:
-			next_state.last_used[y] = 1;
-
-			//check for validity:
-			bool valid = true;
-			if (use_within != 0) {
-				for (auto const last_used : next_state.last_used) {
-					if (last_used == 0) {
-						//if not used yet, then treat as if yarn was last used just left of x=0:
-						// i.e., moving over x=0, state would have last_used=1, so next_state should have last_used=2
-						if (x + 2 > use_within) valid = false;
-					} else {
-						if (last_used > use_within) valid = false;
-					}
-				}
-			}
-			if (cross_within != 0) {
-				if (next_state.last_cross == 0) {
-					//no crossings yet, so make sure we aren't past the window:
-					if (x + 2 > cross_within) valid = false;
-				} else {
-					if (next_state.last_cross > cross_within) valid = false;
-				}
+		}
+
+		return base;
+	}
+
+	//use yarn 'y' in an advanced() state; returns false if the result isn't valid:
+	bool use(DitherParams const &params, uint32_t x, uint32_t y) {
+		uint32_t cross_within = params.cross_within;
+
+		//update for crossings:
+		if (cross_within != 0 //cross_within must be enabled
+		 && last_used[y] != 0 //yarn must have been used
+		 && last_used[y] % 2 == 0) { //and yarn must have been used an even number of steps ago (since it's about to be used an odd number of steps ago)
+		 	//if there is no last crossing, or the last crossing was before this crossing, update it:
+			if (last_cross == 0 || last_cross > last_used[y]) {
+				last_cross = last_used[y];
 			}
+		}
+		//mark the yarn used:
+		last_used[y] = 1;
 
-			if (valid) {
-				cb( y, next_state );
+		//check for validity:
+		if (cross_within != 0) {
+			if (last_cross == 0) {
+				//no crossings yet, so make sure we aren't past the window:
+				if (x + 2 > cross_within) return false;
+			} else {
+				if (last_cross > cross_within) return false;
 			}
 		}
+
+		return true;
 	}
 };
 
@@ -142,10 +318,12 @@ namespace std {
 	template< >
 	struct hash< State > {
 		size_t operator()(State const &s) const {
-			static std::hash< std::string > h;
-			std::string str(reinterpret_cast< const char * >(s.last_used.data()), s.last_used.size());
-			return h(str) ^ (size_t(s.last_cross) << (8*(sizeof(size_t)-1)));
+			//multiply-xorshift mix of the packed counters:
+			std::array< uint64_t, 2 > words = s.last_used.words();
+			uint64_t h = words[0] * 0x9e3779b97f4a7c15ull;
+			h ^= (words[1] ^ (uint64_t(s.last_cross) << 56 | s.last_used.count)) * 0xc2b2ae3d27d4eb4full;
+			h ^= h >> 29;
+			return size_t(h);
 		}
 	};
 }
-
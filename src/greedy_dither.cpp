@@ -1,64 +1,286 @@
 #include "dither.hpp"
+#include "Tables.hpp"
+#include "JobQueue.hpp"
 
 #include <chrono>
-#include <unordered_set>
+#include <sstream>
+#include <mutex>
+#include <numeric>
+#include <algorithm>
 
-std::vector< uint8_t > greedy_dither(DitherParams const &params) {
+//greedy dither with State operations compiled for 'Yarns' yarns (or generic, if Yarns == 0):
+// states are indices into the same transition tables the optimal dither uses (see Tables.hpp)
+template< uint32_t Yarns >
+static std::vector< uint8_t > greedy_dither_yarns(DitherParams const &params) {
+	std::ostream &log = *params.log;
 
 	uint32_t const image_width = params.image_width;
 	uint32_t const image_height = params.image_height;
 	std::vector< Color::Linear > const &yarns_linear = params.yarns_linear;
-	Difference const &difference = params.difference;
+	std::unique_ptr< DifferenceBatch > const difference_batch_ = params.difference.batch(yarns_linear);
+	DifferenceBatch const &difference_batch = *difference_batch_;
 	//a copy because diffusion needs to modify it:
 	std::vector< Color::Linear > image_linear = params.image_linear;
 
-	//this will probably eventually be in params:
-	uint32_t const beam_width = 100;
+	uint32_t const beam_width = params.beam_width; //passes continue until this many states reach the end of the row
+	uint32_t const block = params.beam_block; //states expanded per column per pass
 	assert(beam_width >= 1);
+	assert(block >= 1);
+
+	std::vector< uint8_t > dither(image_width * image_height);
 
-	std::vector< uint8_t > dither;
-	dither.reserve(image_width * image_height);
+	JobQueue job_queue(params.max_threads, log);
+
+	//transition tables (built here unless the caller passed some in params.tables):
+	Tables built_tables;
+	if (!params.tables) {
+		built_tables = get_tables(params, &job_queue);
+		if (params.prune_dominated) build_dominance(&built_tables, params);
+	}
+	Tables const &tables = (params.tables ? *params.tables : built_tables);
+	assert(tables.has_dominance() || !params.prune_dominated);
+	uint32_t const state_count = tables.states.size();
 
 	//initial state:
-	State init(yarns_linear.size());
-	//mark all yarns as unused:
-	for (auto &last_used : init.last_used) {
-		last_used = 0;
+	uint32_t init;
+	{
+		State state(yarns_linear.size());
+		//mark all yarns as unused:
+		for (auto &last_used : state.last_used) {
+			last_used = 0;
+		}
+		//no crossing yet:
+		state.last_cross = 0;
+		init = std::find(tables.states.begin(), tables.states.end(), state) - tables.states.begin();
+		assert(init < state_count);
+	}
+
+	//"push"-style copy of the tables' transitions:
+	std::vector< uint32_t > first_to;
+	std::vector< uint32_t > tos;
+	push_transitions(tables, &first_to, &tos);
+
+	//rank[s] is state s's position in State's ordering, used to break ties between equal-cost states:
+	std::vector< uint32_t > rank(state_count);
+	{
+		std::vector< uint32_t > order(state_count);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){
+			return tables.states[a] < tables.states[b];
+		});
+		for (uint32_t i = 0; i < state_count; ++i) {
+			rank[order[i]] = i;
+		}
+	}
+
+	//dominance_position[s] is state s's position in tables.dominance_order (for drop_dominated, below):
+	std::vector< uint32_t > dominance_position;
+	if (params.prune_dominated) {
+		dominance_position.resize(state_count);
+		for (uint32_t i = 0; i < state_count; ++i) {
+			dominance_position[tables.dominance_order[i]] = i;
+		}
 	}
-	//no crossing yet:
-	init.last_cross = 0;
 
+	//eliminate (some) dead states -- is moving into state 'to' at column x hopeless?
+	// (this might not be 100% right -- setting use_within == yarns gives odd results)
+	//the i-th most urgent yarn (sorted by steps until it must be used) must be used within i+1 steps, unless the row ends first;
+	// so, if 'first_late' is the first i that can't be, the state is dead while x + first_late + 1 <= image_width.
+	auto first_late = [&](State const &next_state, uint32_t x) -> uint32_t {
+		//compute how many steps until each yarn must be used:
+		std::array< uint8_t, State::MaxYarns > within;
+		uint32_t const yarns = next_state.yarns< Yarns >();
+
+		for (uint32_t i = 0; i < yarns; ++i) {
+			uint8_t lu = next_state.last_used[i];
+			if (lu == 0) {
+				int32_t w = int32_t(params.use_within) - int32_t(x+1);
+				assert(w >= 0);
+				within[i] = w;
+			} else {
+				int32_t w = 1 + int32_t(params.use_within) - int32_t(lu);
+				assert(w >= 0);
+				within[i] = w;
+			}
+		}
+
+		std::sort(within.begin(), within.begin() + yarns);
+		for (uint32_t i = 0; i < yarns; ++i) {
+			if (within[i] < i + 1) return i;
+		}
+		return yarns;
+	};
+	//states with every yarn used don't depend on x, so their first_late is computed once:
+	constexpr uint8_t DependsOnX = 0xff;
+	std::vector< uint8_t > state_first_late(state_count, DependsOnX);
+	if (params.use_within != 0) {
+		for (uint32_t s = 0; s < state_count; ++s) {
+			State const &state = tables.states[s];
+			bool unused = false;
+			for (uint32_t i = 0; i < state.yarns< Yarns >(); ++i) {
+				if (state.last_used[i] == 0) unused = true;
+			}
+			if (!unused) state_first_late[s] = first_late(state, 0);
+		}
+	}
+	auto dead = [&](uint32_t to, uint32_t x) -> bool {
+		if (params.use_within == 0) return false;
+		uint32_t late = state_first_late[to];
+		if (late == DependsOnX) late = first_late(tables.states[to], x);
+		return late < tables.states[to].yarns< Yarns >() && x + late + 1 <= image_width;
+	};
+
+	//states visited at one column, in flat arrays, with an open-addressing index:
 	struct Layer {
-		std::unordered_map< State, Cost > visited;
-		std::unordered_set< State > to_expand;
+		std::vector< uint32_t > states; //visited states
+		std::vector< Cost > costs; //lowest cost found so far for each
+		std::vector< uint32_t > backs; //(yarn << YARN_SHIFT) | (entry in the previous layer) that the lowest cost came from
+		std::vector< uint8_t > queued; //is the entry in to_expand?
+		std::vector< uint32_t > to_expand; //entries that haven't been expanded (since their cost last dropped)
+
+		std::vector< uint32_t > slots; //entry + 1 for each used slot, 0 for empty ones; size is a power of two
+
+		static uint32_t hash(uint32_t state) { return state * 0x9e3779b1u; }
+
+		//entry for 'state', or -1U if it hasn't been visited:
+		uint32_t find(uint32_t state) const {
+			if (slots.empty()) return -1U;
+			uint32_t const mask = slots.size() - 1;
+			for (uint32_t i = hash(state) & mask; slots[i] != 0; i = (i + 1) & mask) {
+				if (states[slots[i] - 1] == state) return slots[i] - 1;
+			}
+			return -1U;
+		}
+		//entry for 'state', adding it (with an infinite cost) if it hasn't been visited:
+		uint32_t insert(uint32_t state) {
+			if (2 * (states.size() + 1) > slots.size()) {
+				//grow (keeping the load factor under a half):
+				std::vector< uint32_t > old_slots = std::move(slots);
+				slots.assign(std::max< size_t >(16, 2 * old_slots.size()), 0);
+				uint32_t const mask = slots.size() - 1;
+				for (uint32_t entry = 0; entry < states.size(); ++entry) {
+					uint32_t i = hash(states[entry]) & mask;
+					while (slots[i] != 0) i = (i + 1) & mask;
+					slots[i] = entry + 1;
+				}
+			}
+			uint32_t const mask = slots.size() - 1;
+			uint32_t i = hash(state) & mask;
+			for (; slots[i] != 0; i = (i + 1) & mask) {
+				if (states[slots[i] - 1] == state) return slots[i] - 1;
+			}
+			slots[i] = states.size() + 1;
+			states.emplace_back(state);
+			costs.emplace_back(std::numeric_limits< Cost >::infinity());
+			backs.emplace_back(-1U);
+			queued.emplace_back(0);
+			return states.size() - 1;
+		}
+		//lower the cost of 'state' to 'cost' (if that's lower), remembering 'back' and queueing it for expansion if it changed:
+		// (so the first of several equal-cost relaxations wins)
+		void relax(uint32_t state, Cost cost, uint32_t back) {
+			uint32_t const entry = insert(state);
+			if (costs[entry] > cost) {
+				costs[entry] = cost;
+				backs[entry] = back;
+				if (!queued[entry]) {
+					queued[entry] = 1;
+					to_expand.emplace_back(entry);
+				}
+			}
+		}
+		//forget every state (keeping the allocated space):
+		void clear() {
+			states.clear();
+			costs.clear();
+			backs.clear();
+			queued.clear();
+			to_expand.clear();
+			std::fill(slots.begin(), slots.end(), 0);
+		}
 	};
 
-	for (uint32_t row = 0; row < image_height; ++row) {
+	//expansions are split over threads once a column has at least this many states to expand:
+	// (below that, handing out the work costs more than it saves)
+	constexpr uint32_t MinParallelExpand = 1024;
+
+	//dither one row, with progress going to 'out':
+	// (if expand_queue isn't null, large expansions are split over its workers)
+	auto dither_row = [&](uint32_t row, std::ostream &out, JobQueue *expand_queue) {
 		auto before = std::chrono::high_resolution_clock::now();
-		std::cout << (row+1) << "/" << image_height << ":"; std::cout.flush();
+		out << (row+1) << "/" << image_height << ":"; out.flush();
 
 		//costs of using each yarn:
-		std::vector< Cost > yarn_costs; //yarn_costs[x * image_width + y] is the cost of using yarn y at pixel x
-		yarn_costs.reserve(image_width * yarns_linear.size());
-		for (uint32_t x = 0; x < image_width; ++x) {
-			Color::Linear px_color = image_linear[row*image_width+x];
-			for (uint32_t y = 0; y < yarns_linear.size(); ++y) {
-				Color::Linear yarn_color = yarns_linear[y];
-				yarn_costs.emplace_back( difference(px_color, yarn_color) );
-			}
-		}
-		assert(yarn_costs.size() == image_width * yarns_linear.size());
+		std::vector< Cost > yarn_costs(image_width * yarns_linear.size()); //yarn_costs[x * yarns + y] is the cost of using yarn y at pixel x
+		difference_batch(image_linear.data() + row*image_width, image_width, yarn_costs.data());
 
 
 		std::vector< Layer > layers;
 		layers.resize(image_width + 1);
 
+		//successors found by each thread during a parallel expansion (merged in order afterward):
+		std::vector< Layer > found(expand_queue ? expand_queue->workers.size() : 0);
+
+		//with params.prune_dominated, entries are dropped from to_expand if a state that dominates them (see build_dominance in Tables.hpp)
+		// has been visited at the same column for no more cost -- anything they could lead to, it can lead to as cheaply:
+		uint64_t expanded_states = 0, dominated_states = 0;
+		uint64_t expanded_transitions = 0, dominated_transitions = 0;
+		std::vector< uint32_t > entry_of(params.prune_dominated ? state_count : 0, -1U); //entry of each state in the layer being checked (or -1U)
+		std::vector< uint64_t > order; //layer entries in dominance_order
+		std::vector< Cost > dominator_costs; //lowest cost of any entry that dominates each layer entry (through a chain of entries)
+		std::vector< Cost > reach_costs; //lower of each layer entry's cost and its dominator_costs
+		//drop the entries in layer.to_expand that are dominated by an entry with a cost no higher:
+		// makes one pass over the layer's entries in dominance_order, pushing costs down the one-step relation
+		// (so only chains of dominators that were all visited at this column are followed)
+		auto drop_dominated = [&](Layer &layer) {
+			if (layer.to_expand.empty()) return;
+			//(sorted as (position << 32 | entry) keys)
+			order.clear();
+			for (uint32_t entry = 0; entry < layer.states.size(); ++entry) {
+				entry_of[layer.states[entry]] = entry;
+				order.emplace_back(uint64_t(dominance_position[layer.states[entry]]) << 32 | entry);
+			}
+			std::sort(order.begin(), order.end());
+			reach_costs.resize(layer.states.size());
+			dominator_costs.resize(layer.states.size());
+			auto dominator_cost = [&](uint32_t entry) {
+				uint32_t const s = layer.states[entry];
+				Cost best = std::numeric_limits< Cost >::infinity();
+				for (uint32_t i = tables.first_dominator[s]; i < tables.first_dominator[s+1]; ++i) {
+					uint32_t d = entry_of[tables.dominators[i]];
+					if (d != -1U) best = std::min(best, reach_costs[d]);
+				}
+				return best;
+			};
+			for (uint64_t key : order) {
+				uint32_t const entry = uint32_t(key);
+				dominator_costs[entry] = dominator_cost(entry);
+				reach_costs[entry] = std::min(dominator_costs[entry], layer.costs[entry]);
+			}
+			//(entries stay in the layer, so backs that point to them still work; they are re-checked if their cost drops again)
+			auto end = std::remove_if(layer.to_expand.begin(), layer.to_expand.end(), [&](uint32_t entry){
+				if (dominator_costs[entry] > layer.costs[entry]) return false;
+				layer.queued[entry] = 0;
+				dominated_states += 1;
+				dominated_transitions += first_to[layer.states[entry]+1] - first_to[layer.states[entry]];
+				return true;
+			});
+			layer.to_expand.erase(end, layer.to_expand.end());
+			for (uint32_t state : layer.states) {
+				entry_of[state] = -1U;
+			}
+		};
+
 		//initial state:
-		layers[0].visited.emplace(init, Cost{0});
-		layers[0].to_expand.emplace(init);
+		{
+			uint32_t entry = layers[0].insert(init);
+			layers[0].costs[entry] = Cost{0};
+			layers[0].queued[entry] = 1;
+			layers[0].to_expand.emplace_back(entry);
+		}
 
 		//work in multiple passes, until enough states arrive at the end:
-		while (layers.back().visited.size() < beam_width) {
+		while (layers.back().states.size() < beam_width) {
 
 			uint32_t x = 0;
 			//skip all the finished layers:
@@ -66,7 +288,7 @@ std::vector< uint8_t > greedy_dither(DitherParams const &params) {
 
 			//oh, actually finished(!)
 			if (x == image_width) {
-				std::cout << " (opt!)"; std::cout.flush();
+				out << " (opt!)"; out.flush();
 				break;
 			}
 
@@ -78,136 +300,156 @@ std::vector< uint8_t > greedy_dither(DitherParams const &params) {
 				Layer &prev = layers[x];
 				Layer &next = layers[x+1];
 
-				if (prev.to_expand.empty()) break; //didn't make it to the end this pass, drat
-
-				std::vector< State > to_expand(prev.to_expand.begin(), prev.to_expand.end());
+				if (params.prune_dominated) drop_dominated(prev);
 
-				//std::cout << "{" << x << ": " << to_expand.size() << "}"; std::cout.flush(); //DEBUG
-
-				//sort lowest costs to the front of to_expand:
-				std::sort(to_expand.begin(), to_expand.end(), [&](State const &a, State const &b){
-					Cost ca = prev.visited.at(a);
-					Cost cb = prev.visited.at(b);
-					if (ca != cb) return ca < cb;
-					else return a < b;
-				});
-
-				const uint32_t block = 200;
+				if (prev.to_expand.empty()) break; //didn't make it to the end this pass, drat
 
-				if (to_expand.size() > block) {
-					to_expand.erase(to_expand.begin() + block, to_expand.end());
+				//move the 'block' lowest-cost entries to the front of to_expand:
+				// (expansion order doesn't matter -- only which entries get expanded -- so there's no need to sort them)
+				uint32_t const count = std::min< uint32_t >(block, prev.to_expand.size());
+				if (prev.to_expand.size() > block) {
+					std::nth_element(prev.to_expand.begin(), prev.to_expand.begin() + block, prev.to_expand.end(), [&](uint32_t a, uint32_t b){
+						Cost ca = prev.costs[a];
+						Cost cb = prev.costs[b];
+						if (ca != cb) return ca < cb;
+						else return rank[prev.states[a]] < rank[prev.states[b]];
+					});
 				}
 
-				for (auto const &state : to_expand) {
-					//expand (find next layer states from) the state:
-					Cost cost = prev.visited.at(state);
-					state.next_states(params, x, [&](uint32_t y, State const &next_state) {
-
-						//eliminate (some) dead states:
-
-						//this might not be 100% right -- setting use_within == yarns gives odd results
-						if (params.use_within != 0) {
-							//compute how many steps until each yarn must be used:
-							std::vector< uint8_t > within;
-							within.reserve(next_state.last_used.size());
-							
-							for (auto const &lu : next_state.last_used) {
-								if (lu == 0) {
-									int32_t w = int32_t(params.use_within) - int32_t(x+1);
-									assert(w >= 0);
-									within.emplace_back(w);
-								} else {
-									int32_t w = 1 + int32_t(params.use_within) - int32_t(lu);
-									assert(w >= 0);
-									within.emplace_back(w);
-								}
-							}
-
-							//make sure there are enough steps to use every yarn that wants to be used in that many steps:
-							std::sort(within.begin(), within.end());
-							for (uint32_t i = 0; i < within.size(); ++i) {
-								if (x + i + 1 > image_width) break; //saved by the boundary
-								if (within[i] < i + 1) return;
-							}
+				//expand (find next layer states from) to_expand[begin, end), relaxing the successors into 'into':
+				auto expand = [&](uint32_t begin, uint32_t end, Layer &into) {
+					for (uint32_t i = begin; i < end; ++i) {
+						uint32_t const entry = prev.to_expand[i];
+						uint32_t const from = prev.states[entry];
+						Cost const cost = prev.costs[entry];
+						for (uint32_t t = first_to[from]; t < first_to[from+1]; ++t) {
+							uint32_t const to = tos[t] & STATE_MASK;
+							uint32_t const y = tos[t] >> YARN_SHIFT;
+							if (!tables.is_reachable(x+1, to)) continue; //(transition isn't valid at this column)
+							if (dead(to, x)) continue;
+							into.relax(to, cost + yarn_costs[x*yarns_linear.size() + y], (y << YARN_SHIFT) | entry);
 						}
-
-						Cost next_cost = cost + yarn_costs[x*yarns_linear.size() + y];
-						auto ret = next.visited.emplace(next_state, next_cost);
-						if (ret.second || ret.first->second > next_cost) {
-							ret.first->second = next_cost;
-							next.to_expand.emplace(next_state);
+					}
+				};
+
+				if (expand_queue && count >= MinParallelExpand && found.size() > 1) {
+					//each worker relaxes a slice of the entries into its own buffer, then the buffers are merged in worker order:
+					// (costs are only ever min'd, and the first equal-cost relaxation wins both within a buffer and in the merge,
+					//  so the merged layer -- costs and backs -- is the same as a serial expansion would make)
+					uint32_t const parts = found.size();
+					for (uint32_t p = 0; p < parts; ++p) {
+						expand_queue->run([&,p](){
+							found[p].clear();
+							expand(uint32_t(uint64_t(count) * p / parts), uint32_t(uint64_t(count) * (p + 1) / parts), found[p]);
+						});
+					}
+					expand_queue->wait();
+					for (Layer const &part : found) {
+						for (uint32_t e = 0; e < part.states.size(); ++e) {
+							next.relax(part.states[e], part.costs[e], part.backs[e]);
 						}
-					});
+					}
+				} else {
+					expand(0, count, next);
+				}
 
-					//mark as expanded:
-					auto f = prev.to_expand.find(state);
-					assert(f != prev.to_expand.end());
-					prev.to_expand.erase(f);
+				//mark as expanded:
+				for (uint32_t i = 0; i < count; ++i) {
+					prev.queued[prev.to_expand[i]] = 0;
+					expanded_transitions += first_to[prev.states[prev.to_expand[i]]+1] - first_to[prev.states[prev.to_expand[i]]];
 				}
+				expanded_states += count;
+				prev.to_expand.erase(prev.to_expand.begin(), prev.to_expand.begin() + count);
 			}
-
-			//std::cout << " (" << x << ":" << layers[std::max(0,int(x)-1)].visited.size() << "/" << beam_width << ")"; std::cout.flush();
 		}
-	
+
 		//read back best path:
 		{
 			//backtrack:
-			std::vector< State > path;
-			path.reserve(image_width + 1);
-
 			std::vector< uint8_t > path_yarns;
 			path_yarns.reserve(image_width);
 
-			assert(!layers.back().visited.empty());
+			Layer const &last = layers.back();
+			assert(!last.states.empty());
 			//find the best final state:
-			State lowest = layers.back().visited.begin()->first;
-			for (auto const &[state, cost] : layers.back().visited) {
-				if (cost < layers.back().visited.at(lowest)) {
-					lowest = state;
+			uint32_t lowest = 0;
+			for (uint32_t entry = 1; entry < last.states.size(); ++entry) {
+				if (last.costs[entry] < last.costs[lowest]
+				 || (last.costs[entry] == last.costs[lowest] && rank[last.states[entry]] < rank[last.states[lowest]])) {
+					lowest = entry;
 				}
 			}
-			std::cout << " cost " << layers.back().visited[lowest];
-
-			path.emplace_back(lowest);
+			out << " cost " << last.costs[lowest];
+			if (params.prune_dominated) {
+				out << " (" << 100.0 * dominated_states / std::max< uint64_t >(1, dominated_states + expanded_states) << "% of states dominated, skipping "
+				    << 100.0 * dominated_transitions / std::max< uint64_t >(1, dominated_transitions + expanded_transitions) << "% of transitions)";
+			}
 
+			//follow the backs:
+			uint32_t entry = lowest;
 			for (uint32_t x = image_width-1; x < image_width; --x) {
 				Layer const &prev = layers[x];
 				Layer const &next = layers[x+1];
 
-				Cost best = std::numeric_limits< Cost >::infinity();
-				uint8_t best_yarn = 0xff;
-				State const *best_from = nullptr;
-				for (auto const &[from_state, from_cost] : prev.visited) {
-					from_state.next_states(params, x, [&](uint32_t y, State const &to_state) {
-						if (to_state != path.back()) return;
-						Cost cost = from_cost + yarn_costs[x * yarns_linear.size() + y];
-						if (cost < best) {
-							best = cost;
-							best_yarn = y;
-							best_from = &from_state;
-						}
-					});
-				}
-				assert(best_from);
-				assert(best <= next.visited.at(path.back()));
-
-				path.emplace_back(*best_from);
-				path_yarns.emplace_back(best_yarn);
+				uint32_t const back = next.backs[entry];
+				assert(back != -1U);
+				uint32_t const y = back >> YARN_SHIFT;
+				uint32_t const from = back & STATE_MASK;
+				assert(y < yarns_linear.size());
+				assert(y == tables.states[next.states[entry]].template used_yarn< Yarns >());
+				//(the previous state's cost may have dropped since it was expanded, but it can't have gone up)
+				assert(prev.costs[from] + yarn_costs[x * yarns_linear.size() + y] <= next.costs[entry]);
+
+				path_yarns.emplace_back(y);
+				entry = from;
 			}
+			assert(layers[0].states[entry] == init);
 
-			std::reverse(path.begin(), path.end());
 			std::reverse(path_yarns.begin(), path_yarns.end());
 
-			dither.insert(dither.end(), path_yarns.begin(), path_yarns.end());
+			std::copy(path_yarns.begin(), path_yarns.end(), dither.begin() + row * image_width);
+
+			#ifndef NDEBUG
+			{ //PARANOIA: the row really does meet the constraints:
+				DitherWindows windows = dither_windows(yarns_linear.size(), dither.data() + row * image_width, image_width);
+				assert(params.use_within == 0 || windows.longest_no_use < params.use_within);
+				assert(params.cross_within == 0 || windows.longest_no_crossing < params.cross_within);
+			}
+			#endif
 		}
 
 		//do error diffusion:
 		error_diffusion(params, row, dither, &image_linear);
 
 		auto after = std::chrono::high_resolution_clock::now();
-		std::cout << " (" <<  std::chrono::duration< double >(after - before).count() * 1000 << "ms)" << std::endl;
+		out << " (" <<  std::chrono::duration< double >(after - before).count() * 1000 << "ms)" << std::endl;
+
+	};
 
+	if (!params.diffuse) {
+		//rows are independent without error diffusion, so do them all at once
+		// (each prints its progress when done, so rows may be reported out of order; expansions within a row stay serial):
+		std::mutex out_mutex;
+		for (uint32_t row = 0; row < image_height; ++row) {
+			job_queue.run([&,row](){
+				std::ostringstream out;
+				dither_row(row, out, nullptr);
+				std::lock_guard< std::mutex > lock(out_mutex);
+				log << out.str(); log.flush();
+			});
+		}
+		job_queue.wait();
+	} else {
+		for (uint32_t row = 0; row < image_height; ++row) {
+			dither_row(row, log, &job_queue);
+		}
 	}
 
 	return dither;
 }
+
+std::vector< uint8_t > greedy_dither(DitherParams const &params) {
+	return with_yarn_count(params.yarns_linear.size(), [&](auto Yarns) {
+		return greedy_dither_yarns< decltype(Yarns)::value >(params);
+	});
+}
@@ -2,6 +2,9 @@
 #include "Color.hpp"
 #include "Cost.hpp"
 #include "dither.hpp"
+#include "select_yarns.hpp"
+#include "Tables.hpp"
+#include "JobQueue.hpp"
 
 #define STBI_ONLY_PNG
 #define STBI_FAILURE_USERMSG
@@ -16,8 +19,6 @@
 #include <cstring>
 #include <vector>
 #include <chrono>
-#include <map>
-#include <set>
 
 int main(int argc, char **argv) {
 	bool mirror_back = true;
@@ -28,6 +29,14 @@ int main(int argc, char **argv) {
 
 	std::string yarns_png = "";
 	uint32_t select_yarns = 0;
+	uint32_t select_histogram = 0; //bits per channel of the color histogram used by --select-yarns (0 == score every pixel)
+	std::string select_method = "auto";
+	constexpr uint32_t DefaultSelectRestarts = 8;
+	uint32_t select_restarts = DefaultSelectRestarts;
+	constexpr uint64_t MaxAutoExhaustiveSubsets = 20000; //'auto' selection searches exhaustively up to this many subsets
+	uint32_t select_trials = 0; //trial-dither this many of the cheapest estimated subsets and keep the best (0 == just use the estimate)
+	constexpr uint32_t DefaultSelectTrialScale = 4;
+	uint32_t select_trial_scale = DefaultSelectTrialScale; //trial dithers run on the image shrunk by this factor
 
 	std::vector< Color::Linear > temp_vec_linear; //because DitherParams needs something to refer to
 	LinearDifference temp_difference; //because DitherParams needs something to refer to
@@ -37,6 +46,17 @@ int main(int argc, char **argv) {
 	uint32_t use_within = default_params.use_within;
 	uint32_t seed = default_params.seed;
 	uint32_t max_threads = default_params.max_threads;
+	std::string table_cache = default_params.table_cache;
+	bool packed_froms = default_params.packed_froms;
+	std::string pull_kernel = default_params.pull_kernel;
+	bool backpointers = default_params.backpointers;
+	bool prune_dominated = default_params.prune_dominated;
+	uint32_t memory_budget = default_params.memory_budget;
+	std::string threading = default_params.threading;
+	uint32_t beam_width = default_params.beam_width;
+	uint32_t beam_block = default_params.beam_block;
+	std::string search = default_params.search;
+	uint32_t search_limit = default_params.search_limit;
 
 	std::string out_front_png = "";
 	std::string out_back_png = "";
@@ -88,6 +108,38 @@ int main(int argc, char **argv) {
 					std::istringstream iss(val);
 					char junk = '\0';
 					if (!(iss >> select_yarns) || (iss >> junk)) throw std::runtime_error("Failed to parse a non-negative integer from '" + val + "'.");
+				} else if (arg == "--select-histogram") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--select-histogram' must be followed by 'off', 'exact', or an integer from 1 to 7.");
+					std::string val = argv[++argi];
+					if (val == "off") select_histogram = 0;
+					else if (val == "exact") select_histogram = 8;
+					else {
+						std::istringstream iss(val);
+						char junk = '\0';
+						if (!(iss >> select_histogram) || (iss >> junk) || select_histogram < 1 || select_histogram > 7) throw std::runtime_error("Failed to parse 'off', 'exact', or an integer from 1 to 7 from '" + val + "'.");
+					}
+				} else if (arg == "--select-method") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--select-method' must be followed by 'auto', 'exhaustive', 'swap', or 'compare'.");
+					select_method = argv[++argi];
+					if (select_method != "auto" && select_method != "exhaustive" && select_method != "swap" && select_method != "compare") throw std::runtime_error("Unrecognized selection method '" + select_method + "'.");
+				} else if (arg == "--select-restarts") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--select-restarts' must be followed by a positive integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> select_restarts) || (iss >> junk) || select_restarts == 0) throw std::runtime_error("Failed to parse a positive integer from '" + val + "'.");
+				} else if (arg == "--select-trials") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--select-trials' must be followed by a non-negative integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> select_trials) || (iss >> junk)) throw std::runtime_error("Failed to parse a non-negative integer from '" + val + "'.");
+				} else if (arg == "--select-trial-scale") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--select-trial-scale' must be followed by a positive integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> select_trial_scale) || (iss >> junk) || select_trial_scale == 0) throw std::runtime_error("Failed to parse a positive integer from '" + val + "'.");
 				} else if (arg == "--out-front") {
 					if (argi + 1 >= argc) throw std::runtime_error("Argument '--out-front' must be followed by a filename.");
 					out_front_png = argv[++argi];
@@ -135,6 +187,51 @@ int main(int argc, char **argv) {
 					std::istringstream iss(val);
 					char junk = '\0';
 					if (!(iss >> max_threads) || (iss >> junk)) throw std::runtime_error("Failed to parse a non-negative integer from '" + val + "'.");
+				} else if (arg == "--threading") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--threading' must be followed by 'team' or 'queue'.");
+					threading = argv[++argi];
+					if (threading != "team" && threading != "queue") throw std::runtime_error("Unrecognized threading '" + threading + "'.");
+				} else if (arg == "--table-cache") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--table-cache' must be followed by a directory name.");
+					table_cache = argv[++argi];
+				} else if (arg == "--froms") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--froms' must be followed by 'flat' or 'packed'.");
+					std::string val = argv[++argi];
+					if (val == "flat") packed_froms = false;
+					else if (val == "packed") packed_froms = true;
+					else throw std::runtime_error("Unrecognized froms layout '" + val + "'.");
+				} else if (arg == "--pull-kernel") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--pull-kernel' must be followed by 'auto', 'scalar', 'avx2', or 'avx512'.");
+					pull_kernel = argv[++argi];
+					if (pull_kernel != "auto" && pull_kernel != "scalar" && pull_kernel != "avx2" && pull_kernel != "avx512") throw std::runtime_error("Unrecognized pull kernel '" + pull_kernel + "'.");
+				} else if (arg == "--memory-budget") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--memory-budget' must be followed by a non-negative integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> memory_budget) || (iss >> junk)) throw std::runtime_error("Failed to parse a non-negative integer from '" + val + "'.");
+				} else if (arg == "--beam-width") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--beam-width' must be followed by a positive integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> beam_width) || (iss >> junk) || beam_width == 0) throw std::runtime_error("Failed to parse a positive integer from '" + val + "'.");
+				} else if (arg == "--beam-block") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--beam-block' must be followed by a positive integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> beam_block) || (iss >> junk) || beam_block == 0) throw std::runtime_error("Failed to parse a positive integer from '" + val + "'.");
+				} else if (arg == "--search") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--search' must be followed by 'dp' or 'astar'.");
+					search = argv[++argi];
+					if (search != "dp" && search != "astar") throw std::runtime_error("Unrecognized search '" + search + "'.");
+				} else if (arg == "--search-limit") {
+					if (argi + 1 >= argc) throw std::runtime_error("Argument '--search-limit' must be followed by a non-negative integer.");
+					std::string val = argv[++argi];
+					std::istringstream iss(val);
+					char junk = '\0';
+					if (!(iss >> search_limit) || (iss >> junk)) throw std::runtime_error("Failed to parse a non-negative integer from '" + val + "'.");
 				} else if (arg == "--cost") {
 					if (argi + 1 >= argc) throw std::runtime_error("Argument '--cost' must be followed by a string.");
 					std::string val = argv[++argi];
@@ -163,6 +260,14 @@ int main(int argc, char **argv) {
 					diffuse = true;
 				} else if (arg == "--no-diffuse") {
 					diffuse = false;
+				} else if (arg == "--backpointers") {
+					backpointers = true;
+				} else if (arg == "--no-backpointers") {
+					backpointers = false;
+				} else if (arg == "--prune-dominated") {
+					prune_dominated = true;
+				} else if (arg == "--no-prune-dominated") {
+					prune_dominated = false;
 				} else {
 					throw std::runtime_error("Unrecognized argument '" + arg + "'.");
 				}
@@ -188,6 +293,11 @@ int main(int argc, char **argv) {
 			usage = true;
 		}
 
+		if (prune_dominated && method != greedy_dither) {
+			std::cerr << "ERROR: '--prune-dominated' only applies to '--method greedy'." << std::endl;
+			usage = true;
+		}
+
 		if (usage) {
 			std::cerr << "Usage:\n"
 			"    optimal-dither --in <in.png> --yarns <yarns.png> --out <out.png> [...]\n"
@@ -198,6 +308,11 @@ int main(int argc, char **argv) {
 			" Yarn Colors: (required)\n"
 			"   --yarns <yarns.png> -- yarn colors, packed into an image (where pixel (0,y) gives the yarn color.)\n"
 			"   --select-yarns <Y> -- pick only Y of the yarn colors, minimizes quantization error (but doesn't run full dither with every option).\n"
+			"   --select-method <auto|exhaustive|swap|compare> (default auto) -- how --select-yarns searches: try every subset; swap yarns in and out until no swap helps (fast, but may miss the best subset); 'auto' tries every subset only if there are at most " << MaxAutoExhaustiveSubsets << "; 'compare' runs both and reports the gap.\n"
+			"   --select-restarts <R> (integer >= 1, default " << DefaultSelectRestarts << ") -- number of (parallel) starting subsets for the swap search.\n"
+			"   --select-trials <K> (integer >= 0, default 0, 0 disables) -- dither a shrunken copy of the image with each of the K cheapest subsets (with all of the options below) and select the one that actually does best.\n"
+			"   --select-trial-scale <F> (integer >= 1, default " << DefaultSelectTrialScale << ") -- shrink the image by this factor in each direction for --select-trials.\n"
+			"   --select-histogram <off|exact|B> (default off) -- have --select-yarns score a weighted histogram of the image's colors instead of every pixel; 'exact' gives each distinct color a bin, B (1-7) merges colors that agree in the top B bits of each channel.\n"
 			" Output Image (specify at least one):\n"
 			"   --out <out.png> (filename) -- output image, interleaved front/back needles.\n"
 			"   --out-front <out-front.png> (filename) -- output image, front only.\n"
@@ -208,7 +323,16 @@ int main(int argc, char **argv) {
 			"   --use-within <U> (integer >= 0, default " << default_params.use_within << ", 0 disables) -- require every U stitches to contain at least one use of every yarn.\n"
 			"   --cross-within <X> (integer >= 0, default " << default_params.cross_within << ", 0 disables) -- require every X stitches to contain at least one front and back use of the same yarn.\n"
 			"   --seed <S> (integer >= 0, default " << default_params.seed << ", 0 always picks first, 1 always picks based on row) -- set the seed for the pseudo-random numbers used to pick between same-cost paths.\n"
-			"   --max-threads <T> (integer >= 0, default " << default_params.max_threads << ", 0 picks automatically) -- limit the number of compute threads.\n";
+			"   --max-threads <T> (integer >= 0, default " << default_params.max_threads << ", 0 picks automatically) -- limit the number of compute threads.\n"
+			"   --threading <team|queue> (default " << default_params.threading << ") -- how the 'optimal' method splits each column over threads: a persistent team that steps through columns together, or jobs on a queue.\n"
+			"   --table-cache <dir> (directory, default none) -- save transition tables in this directory, and re-use them on later runs.\n"
+			"   --froms <flat|packed> (default " << (default_params.packed_froms ? "packed" : "flat") << ") -- layout of the transitions read by the 'optimal' method's inner loop; 'packed' uses less memory bandwidth but needs decoding.\n"
+			"   --pull-kernel <auto|scalar|avx2|avx512> (default " << default_params.pull_kernel << ") -- version of the 'optimal' method's inner loop (for the flat froms layout); all give identical results.\n"
+			"   --memory-budget <MB> (integer >= 0, default " << default_params.memory_budget << ", 0 disables) -- limit on the 'optimal' method's cost storage; past it, only some columns are stored and the rest are re-computed during readback (same results, more time).\n"
+			"   --beam-width <W> (integer >= 1, default " << default_params.beam_width << ") -- the 'greedy' method keeps making passes over a row until W states reach its end.\n"
+			"   --beam-block <B> (integer >= 1, default " << default_params.beam_block << ") -- the 'greedy' method expands the B cheapest states at each column on each pass (large blocks are expanded in parallel).\n"
+			"   --search <dp|astar> (default " << default_params.search << ") -- how the 'optimal' method finds each row's cheapest cost: a forward pass over every state, or a best-first search (same output).\n"
+			"   --search-limit <N> (integer >= 0, default " << default_params.search_limit << ", 0 picks automatically) -- (state, column) pairs the 'astar' search may visit in a row before doing the forward pass instead.\n";
 
 			std::cerr << "   --cost <";
 			for (Difference const *d : differences) {
@@ -227,6 +351,8 @@ int main(int argc, char **argv) {
 
 			std::cerr <<
 			"   --diffuse / --no-diffuse (default is to diffuse) -- should quantization error be diffused to later rows.\n"
+			"   --backpointers / --no-backpointers (default is " << (default_params.backpointers ? "" : "no ") << "backpointers) -- should the 'optimal' method remember where each cost came from (uses more memory; saves re-scanning during readback).\n"
+			"   --prune-dominated / --no-prune-dominated (default is " << (default_params.prune_dominated ? "" : "not ") << "to prune) -- should the 'greedy' method drop states that a no more expensive state at the same column dominates (only for '--method greedy').\n"
 			;
 			std::cerr.flush();
 			return 1;
@@ -272,8 +398,9 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	if (select_yarns > 32) {
-		std::cerr << "WARNING: using " << select_yarns << " yarns; is likely to either out-of-memory or at least result in some bugs in state indexing. (Continuing anyway, but expect crashes/bugs.)" << std::endl;
+	if (select_yarns > State::MaxYarns) {
+		std::cerr << "ERROR: using " << select_yarns << " yarns; dither states only have room for " << State::MaxYarns << " yarns (and will likely run out of memory well before that)." << std::endl;
+		return 1;
 	}
 
 	std::vector< uint32_t > image;
@@ -374,9 +501,29 @@ int main(int argc, char **argv) {
 	std::cout << "'.\n";
 	std::cout << " Use within is " << use_within << (use_within == 0 ? " (disabled)" : "")
 	          << " and cross within is " << cross_within << (cross_within == 0 ? " (disabled)" : "") << ".\n";
+	if (MinSpecializedYarns <= select_yarns && select_yarns <= MaxSpecializedYarns) std::cout << " Using code specialized for " << select_yarns << " yarns.\n";
+	else std::cout << " Using generic code for " << select_yarns << " yarns (only " << MinSpecializedYarns << " through " << MaxSpecializedYarns << " are specialized).\n";
+	if (select_yarns < yarns.size() && select_trials != 0) std::cout << " Yarns will be selected by trial dithers of the " << select_trials << " best estimates on an image shrunk by " << select_trial_scale << ".\n";
+	if (select_yarns < yarns.size() && select_method != "auto") std::cout << " Yarns will be selected with the '" << select_method << "' method.\n";
+	if (select_yarns < yarns.size() && select_histogram != 0) {
+		std::cout << " Yarns will be selected using a color histogram with " << (select_histogram == 8 ? "exact colors" : std::to_string(select_histogram) + " bits per channel") << ".\n";
+	}
 	std::cout << " Cost function is '" << difference->name() << "' -- " << difference->help() << ".\n";
 	std::cout << " Random seed is " << seed << ".\n";
-	std::cout << " Will use up to " << max_threads << (max_threads == 0 ? " (auto)" : "") << " threads.\n";
+	std::cout << " Will use up to " << max_threads << (max_threads == 0 ? " (auto)" : "") << " threads (as a " << threading << ").\n";
+	if (table_cache != "") std::cout << " Transition tables will be cached in '" << table_cache << "'.\n";
+	std::cout << " Transitions will be read in the " << (packed_froms ? "packed" : "flat") << " layout";
+	if (!packed_froms) std::cout << " with the '" << pull_kernel << "' pull kernel";
+	std::cout << ".\n";
+	if (backpointers) std::cout << " Backpointers will be stored.\n";
+	if (prune_dominated) std::cout << " Dominated states will be pruned.\n";
+	if (memory_budget != 0) std::cout << " Cost storage will be limited to " << memory_budget << "MB.\n";
+	if (method == optimal_dither && search != "dp") {
+		std::cout << " Rows will be searched with '" << search << "'";
+		if (search_limit != 0) std::cout << " (visiting at most " << search_limit << " pairs)";
+		std::cout << ".\n";
+	}
+	if (method == greedy_dither) std::cout << " Beam search will expand " << beam_block << " states per column per pass until " << beam_width << " reach the end of the row.\n";
 	if (diffuse) std::cout << " Error will be diffused to the next row.\n";
 	else std::cout << " No error diffusion will be used.\n";
 	std::cout << "------------------------------------\n";
@@ -384,61 +531,166 @@ int main(int argc, char **argv) {
 
 	
 	if (select_yarns < yarns.size()) { //Estimate the optimal subset of yarns based on quantization error without accounting for error diffusion or fabrication constraints:
-		std::cout << "Determining subset of yarn colors by trying all without constraints:" << std::endl;
-
-		//permutations of selected correspond to subsets of the yarns:
-		std::vector< uint8_t > selected(yarns.size(), 0);
-		for (uint32_t i = yarns.size() - select_yarns; i < yarns.size(); ++i) {
-			selected[i] = 1;
+		uint64_t const subsets = count_subsets(yarns.size(), select_yarns);
+		bool const exhaustive = (select_method == "exhaustive" || select_method == "compare" || (select_method == "auto" && subsets <= MaxAutoExhaustiveSubsets));
+		bool const swap = (select_method == "swap" || select_method == "compare" || !exhaustive);
+		if (exhaustive) std::cout << "Determining subset of yarn colors by trying all " << subsets << " without constraints:" << std::endl;
+		else std::cout << "Determining subset of yarn colors by local search (" << subsets << " subsets is too many to try all) without constraints:" << std::endl;
+
+		//colors to score (every pixel, or the bins of a histogram):
+		std::vector< Color::Linear > const *px_linear = &image_linear;
+		ColorHistogram histogram;
+		if (select_histogram != 0) {
+			std::cout << "  Building color histogram..."; std::cout.flush();
+			histogram = color_histogram(image, select_histogram);
+			px_linear = &histogram.colors;
+			std::cout << " done. (" << histogram.colors.size() << " bins for " << image.size() << " pixels.)" << std::endl;
 		}
 
 		std::cout << "  Precomputing all costs..."; std::cout.flush();
 		//precompute costs from all yarns to all pixels:
 		std::vector< std::vector< Cost > > yarn_px_costs(yarns.size());
-		for (uint32_t y = 0; y < yarns.size(); ++y) {
-			yarn_px_costs[y].reserve(image.size());
-			Color::Linear const &yarn_color = yarns_linear[y];
-			for (uint32_t i = 0; i < image.size(); ++i) {
-				Color::Linear const &px_color = image_linear[i];
-				yarn_px_costs[y].emplace_back( (*difference)(px_color, yarn_color) );
+		{
+			//(computed a row at a time, as px-major rows, then transposed)
+			std::unique_ptr< DifferenceBatch > difference_batch = difference->batch(yarns_linear);
+			std::vector< Cost > px_yarn_costs(image_width * yarns.size());
+			for (uint32_t y = 0; y < yarns.size(); ++y) {
+				yarn_px_costs[y].resize(px_linear->size());
+			}
+			for (uint32_t i = 0; i < px_linear->size(); i += image_width) {
+				uint32_t count = std::min< uint32_t >(image_width, px_linear->size() - i);
+				(*difference_batch)(px_linear->data() + i, count, px_yarn_costs.data());
+				for (uint32_t p = 0; p < count; ++p) {
+					for (uint32_t y = 0; y < yarns.size(); ++y) {
+						yarn_px_costs[y][i + p] = px_yarn_costs[p * yarns.size() + y];
+					}
+				}
 			}
 		}
 		std::cout << " done." << std::endl;
 
-		Cost min_cost = std::numeric_limits< float >::infinity();
-		std::vector< uint8_t > min_selected(yarns.size(), 0);
+		std::vector< float > const *weights = (select_histogram != 0 ? &histogram.weights : nullptr);
+		YarnSelection selection;
+		if (exhaustive) {
+			std::cout << "  Trying all combinations..." << std::endl;
+			selection = select_yarns_exhaustive(yarn_px_costs, select_yarns, max_threads, weights, std::max(1u, select_trials));
+			std::cout << "  ...done. (" << selection.subsets << " total, " << selection.cut_short << " cut short once they couldn't win.)" << std::endl;
+		}
+		if (swap) {
+			std::cout << "  Swapping yarns from " << select_restarts << " starting subsets..." << std::endl;
+			auto before = std::chrono::steady_clock::now();
+			YarnSelection swapped = select_yarns_swap(yarn_px_costs, select_yarns, max_threads, weights, select_restarts, std::max(1u, select_trials));
+			auto after = std::chrono::steady_clock::now();
+			std::cout << "  ...done. (" << swapped.swaps << " swaps in " << std::chrono::duration< double >(after - before).count() << "s.)" << std::endl;
+			if (exhaustive) {
+				std::cout << "  Swap search cost " << swapped.cost << " vs. " << selection.cost << " for trying all (a gap of " << (swapped.cost - selection.cost);
+				//(relative gap is only meaningful if trying all found a nonzero cost)
+				if (selection.cost > 0) std::cout << ", or " << 100.0 * (swapped.cost - selection.cost) / selection.cost << "%";
+				std::cout << ")" << (swapped.selected == selection.selected ? "; same subset.\n" : "; different subset.\n");
+			} else {
+				selection = swapped;
+			}
+		}
+		std::vector< uint8_t > min_selected = selection.selected;
+		Cost min_cost = selection.cost;
+
+		if (select_trials > 0 && selection.candidates.size() > 1) {
+			//shrink the image by averaging select_trial_scale x select_trial_scale blocks (of front or of back pixels):
+			uint32_t scale = std::min(select_trial_scale, std::min(image_width / 2, image_height));
+			scale = std::max(scale, 1u);
+			uint32_t const trial_width = 2 * ((image_width / 2) / scale);
+			uint32_t const trial_height = image_height / scale;
+			std::vector< Color::Linear > trial_linear(trial_width * trial_height);
+			for (uint32_t row = 0; row < trial_height; ++row) {
+				for (uint32_t x = 0; x < trial_width; ++x) {
+					Color::Linear sum{.r = 0.0f, .g = 0.0f, .b = 0.0f};
+					for (uint32_t dy = 0; dy < scale; ++dy) {
+						for (uint32_t dx = 0; dx < scale; ++dx) {
+							Color::Linear const &px = image_linear[(row * scale + dy) * image_width + 2 * ((x / 2) * scale + dx) + (x % 2)];
+							sum.r += px.r;
+							sum.g += px.g;
+							sum.b += px.b;
+						}
+					}
+					float const inv = 1.0f / float(scale * scale);
+					trial_linear[row * trial_width + x] = Color::Linear{.r = sum.r * inv, .g = sum.g * inv, .b = sum.b * inv};
+				}
+			}
 
-		uint32_t combinations = 0;
+			std::vector< YarnSubset > const &candidates = selection.candidates;
+			std::cout << "  Trial dithering the " << candidates.size() << " cheapest subsets on a " << trial_width << "x" << trial_height << " copy of the image..." << std::endl;
 
-		std::cout << "  Trying all combinations... "; std::cout.flush();
-		do {
-			std::vector< Cost const * > to_min;
-			to_min.reserve(select_yarns);
-			for (uint32_t y = 0; y < selected.size(); ++y) {
-				if (selected[y] != 0) {
-					to_min.emplace_back(yarn_px_costs[y].data());
+			std::vector< std::vector< Color::Linear > > candidate_linear(candidates.size());
+			for (uint32_t c = 0; c < candidates.size(); ++c) {
+				for (uint32_t y = 0; y < candidates[c].selected.size(); ++y) {
+					if (candidates[c].selected[y]) candidate_linear[c].emplace_back(yarns_linear[y]);
 				}
 			}
-			assert(to_min.size() == select_yarns);
 
-			Cost total_cost = 0;
-			for (uint32_t i = 0; i < image.size(); ++i) {
-				Cost px_min = to_min[0][i];
-				for (uint32_t y = 1; y < to_min.size(); ++y) {
-					px_min = std::min(px_min, to_min[y][i]);
+			//every trial runs on one thread (trials run in parallel instead):
+			auto trial_params = [&](uint32_t c) {
+				return DitherParams{
+					.yarns_linear=candidate_linear[c],
+					.image_width=trial_width,
+					.image_height=trial_height,
+					.image_linear=trial_linear,
+					.use_within=use_within,
+					.cross_within=cross_within,
+					.difference=*difference,
+					.diffuse=diffuse,
+					.seed=seed,
+					.max_threads=1,
+					.threading=threading,
+					.table_cache=table_cache,
+					.packed_froms=packed_froms,
+					.backpointers=backpointers,
+					.pull_kernel=pull_kernel,
+					.memory_budget=memory_budget,
+					.beam_width=beam_width,
+					.beam_block=beam_block,
+					.search=search,
+					.search_limit=search_limit,
+					.prune_dominated=prune_dominated,
+				};
+			};
+
+			//the transition tables only depend on the yarn count and the constraints, so all trials share one copy:
+			Tables trial_tables = get_tables(trial_params(0), nullptr);
+			if (packed_froms) pack_froms(&trial_tables);
+			if (prune_dominated) build_dominance(&trial_tables, trial_params(0));
+
+			std::vector< Cost > trial_costs(candidates.size(), 0);
+			{
+				JobQueue job_queue(max_threads);
+				for (uint32_t c = 0; c < candidates.size(); ++c) {
+					job_queue.run([&,c](){
+						//(the dithers' progress messages would be interleaved nonsense, so each trial writes them to its own null stream)
+						std::ostream quiet(nullptr);
+						DitherParams params = trial_params(c);
+						params.tables = &trial_tables;
+						params.log = &quiet;
+						std::vector< uint8_t > trial = method(params);
+						assert(trial.size() == trial_linear.size());
+						//(same cost as the final check, below)
+						Cost total = 0;
+						for (uint32_t i = 0; i < trial.size(); ++i) {
+							total += (*difference)(candidate_linear[c][trial[i]], trial_linear[i]);
+						}
+						trial_costs[c] = total;
+					});
 				}
-				total_cost += px_min;
-				//if (total_cost > min_cost) break; //early out for really bad choices
-			}
-			if (total_cost < min_cost) {
-				min_cost = total_cost;
-				min_selected = selected;
+				job_queue.wait();
 			}
 
-			++combinations;
-		} while (std::next_permutation(selected.begin(), selected.end()));
-
-		std::cout << " done. (" << combinations << " total.)" << std::endl;
+			uint32_t best = 0;
+			for (uint32_t c = 0; c < candidates.size(); ++c) {
+				std::cout << "    subset " << (c+1) << ": estimated " << candidates[c].cost << ", trial dither " << trial_costs[c] << "\n";
+				if (trial_costs[c] < trial_costs[best]) best = c;
+			}
+			std::cout << "  ...done. (subset " << (best+1) << " did best.)" << std::endl;
+			min_selected = candidates[best].selected;
+			min_cost = candidates[best].cost;
+		}
 
 		std::cout << "  Selected:\n";
 
@@ -481,6 +733,17 @@ int main(int argc, char **argv) {
 		.diffuse=diffuse,
 		.seed=seed,
 		.max_threads=max_threads,
+		.threading=threading,
+		.table_cache=table_cache,
+		.packed_froms=packed_froms,
+		.backpointers=backpointers,
+		.pull_kernel=pull_kernel,
+		.memory_budget=memory_budget,
+		.beam_width=beam_width,
+		.beam_block=beam_block,
+		.search=search,
+		.search_limit=search_limit,
+		.prune_dominated=prune_dominated,
 	};
 
 	std::vector< uint8_t > dithered;
@@ -492,72 +755,17 @@ int main(int argc, char **argv) {
 	bool invalid_image = false;
 	
 	{ //CHECK the resulting dither:
-		uint32_t longest_no_use = 0;
-		uint32_t longest_no_crossing = 0;
-		Cost total_cost = 0;
-		for (uint32_t row = 0; row < image_height; ++row) {
-			bool error_row = false;
-			for (uint32_t x = 0; x < image_width; ++x) {
-
-				//these checks are written to be simple, not to be efficient
-
-				//check longest window starting at x that doesn't use all yarns:
-				std::set< uint8_t > used_yarns; //which yarns have been seen in the window
-				uint32_t uw = 0;
-				for (uint32_t x2 = x; x2 < image_width; ++x2) {
-					//add yarns until all have been seen:
-					uint8_t y = dithered[row * image_width + x2];
-					assert(y < yarns_linear.size());
-					used_yarns.emplace(y);
-					if (used_yarns.size() == yarns_linear.size()) break;
-					uw = x2+1-x;
-
-					longest_no_use = std::max(longest_no_use, uw);
-				}
-				if (use_within != 0 && uw+ 1 > use_within) error_row = true;
-
-				//check longest window starting at x that doesn't contain a crossing:
-				std::map< uint8_t, uint32_t > last_use;
-				uint32_t cw = 0;
-				for (uint32_t x2 = x; x2 < image_width; ++x2) {
-					uint8_t y = dithered[row * image_width + x2];
-					assert(y < yarns_linear.size());
-					//check for crossing
-					auto f = last_use.find(y);
-					if (f != last_use.end()) {
-						uint32_t span = x2 - f->second;
-						if (span % 2 != 0) {
-							//have a crossing
-							break;
-						}
-					}
-					//remember this use of the yarn:
-					last_use[y] = x2;
-					
-					cw = x2+1-x;
-					longest_no_crossing = std::max(longest_no_crossing, cw);
-				}
-				if (cross_within != 0 && cw+1 > cross_within) error_row = true;
+		DitherWindows windows = dither_windows(yarns_linear.size(), dithered, image_width, image_height, max_threads);
+		uint32_t const longest_no_use = windows.longest_no_use;
+		uint32_t const longest_no_crossing = windows.longest_no_crossing;
 
-				//DEBUG:
-				//std::cout << x << " " << char('a' + dithered[row * image_width + x]) << " " << uw << " " << cw;
-				//if (uw + 1 > use_within || cw + 1 > cross_within) std::cout << "  ***";
-				//std::cout << std::endl;
-
-				//accumulate cost:
-				total_cost += (*difference)(yarns_linear[dithered[row * image_width + x]], image_linear[row * image_width + x]);
-			}
-
-			/*//DEBUG:
-			if (error_row) {
-				for (uint32_t x = 0; x < image_width; ++x) {
-					std::cout << char('a' + dithered[row * image_width + x]);
-				}
-				std::cout << std::endl;
-				break;
-			}
-			*/
+		//(summed in pixel order, so the total doesn't depend on threading)
+		Cost total_cost = 0;
+		for (uint32_t i = 0; i < dithered.size(); ++i) {
+			assert(dithered[i] < yarns_linear.size());
+			total_cost += (*difference)(yarns_linear[dithered[i]], image_linear[i]);
 		}
+
 		std::cout << "Shortest window with all yarns being used is " << longest_no_use + 1 << " (requested: " << use_within << ")." << std::endl;
 		std::cout << "Shortest window which always has a crossing is " << longest_no_crossing + 1 << " (requested: " << cross_within << ")." << std::endl;
 		std::cout << "Total cost of dither was " << total_cost << std::endl;
@@ -1,10 +1,19 @@
 #include "dither.hpp"
+#include "Tables.hpp"
+#include "pull_costs.hpp"
+
+#define USE_THREADS
+#ifdef USE_THREADS
+#include "JobQueue.hpp"
+#include "ThreadTeam.hpp"
+#endif
 
 #include <array>
 #include <iostream>
 #include <string>
 #include <cstring>
 #include <vector>
+#include <span>
 #include <map>
 #include <chrono>
 #include <thread>
@@ -16,89 +25,16 @@
 #include <unordered_map>
 #include <set>
 #include <random>
-
-#define USE_THREADS
-#ifdef USE_THREADS
-
-struct JobQueue {
-	struct Shared {
-		std::deque< std::function< void() > > queue;
-		std::mutex mutex;
-		std::condition_variable cv;
-		bool quit = false;
-
-		uint32_t pending = 0;
-		std::condition_variable done_cv;
-	} shared;
-	std::vector< std::thread > workers;
-
-	JobQueue(uint32_t max_threads) {
-		unsigned int n = std::thread::hardware_concurrency();
-		if (max_threads != 0) n = std::min(n, max_threads);
-		std::cout << "Spawning " << n << " worker threads." << std::endl;
-		workers.reserve(n);
-		for (unsigned int i = 0; i < n; ++i) {
-			//making a non-member-variable pointer to copy to thread:
-			workers.emplace_back(worker_main, &shared);
-		}
-	}
-	~JobQueue() {
-		std::cout << " Waiting for worker threads to exit..."; std::cout.flush();
-		{
-			std::lock_guard< std::mutex > lock(shared.mutex);
-			shared.queue.clear();
-			shared.quit = true;
-			shared.cv.notify_all();
-		}
-		for (auto &worker : workers) {
-			worker.join();
-		}
-		std::cout << " done." << std::endl;
-	}
-
-	void run(std::function< void() > const &fn) {
-		std::lock_guard< std::mutex > lock(shared.mutex);
-		shared.queue.emplace_back(fn);
-		shared.cv.notify_one();
-	}
-	void wait() {
-		std::unique_lock< std::mutex > lock(shared.mutex);
-		while (!(shared.queue.empty() && shared.pending == 0)) {
-			shared.done_cv.wait(lock);
-		}
-	}
-
-	static void worker_main(Shared *shared_) {
-		Shared &shared = *shared_;
-
-		std::unique_lock< std::mutex > lock(shared.mutex);
-		while (!shared.quit) {
-			if (shared.queue.empty()) {
-				shared.cv.wait(lock);
-			} else {
-				std::function< void() > fn = std::move(shared.queue.front());
-				shared.queue.pop_front();
-				shared.pending += 1;
-				lock.unlock();
-
-				fn();
-
-				lock.lock();
-				shared.pending -= 1;
-				shared.done_cv.notify_all();
-			}
-		}
-	}
-
-};
-
-#endif
+#include <sstream>
+#include <memory>
+#include <atomic>
 
 
 std::vector< uint8_t > optimal_dither(DitherParams const &params) {
+	std::ostream &log = *params.log;
 
 #ifdef USE_THREADS
-	JobQueue job_queue(params.max_threads);
+	JobQueue job_queue(params.max_threads, log);
 #endif
 
 	std::vector< Color::Linear > const &yarns_linear = params.yarns_linear;
@@ -109,197 +45,50 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 	std::vector< Color::Linear > image_linear = params.image_linear;
 
 	Difference const &difference = params.difference;
+	std::unique_ptr< DifferenceBatch > const difference_batch_ = difference.batch(yarns_linear);
+	DifferenceBatch const &difference_batch = *difference_batch_;
 
-	bool print_state_table = false; //show the states and their transitions
-
-	constexpr uint32_t YARN_SHIFT = 27;
-	constexpr uint32_t STATE_MASK = 0x07ffffff;
-	static_assert(~(31u << YARN_SHIFT) == STATE_MASK, "Yarn shift avoids state mask perfectly.");
-
-	struct Table {
-		std::vector< State > states;
-
-		//"pull"-style propagation from previous table:
-		std::vector< uint32_t > first_from; //first index to read from for each state
-		std::vector< uint32_t > froms; //(yarn index << 26) | (prev table state index)
-
+	//tables.states are the states before selecting a yarn for any column (tables.is_reachable says which ones can appear at column x):
+	// (these are built here unless the caller passed some in params.tables)
+	Tables built_tables;
+	if (!params.tables) {
 		#ifdef USE_THREADS
-		//try to give each worker about the same number of 'froms' to deal with:
-		std::vector< uint32_t > worker_first_to;
-		#endif //USE_THREADS
-	};
-
-	//tables[x] is the states before selecting a yarn for column x:
-	std::vector< Table > tables;
-	tables.reserve(image_width + 1); //okay, a lot of these are probably redundant, right?
-
-	{ //build all valid states and the transition table between them.
-		auto before = std::chrono::high_resolution_clock::now();
-
-		//NOTE: with current code, a 6-yarn table build takes about 49sec; 5-yarn takes about 2.7sec
-
-		{ //initial table:
-			State init(yarns_linear.size());
-			//mark all yarns as unused:
-			for (auto &last_used : init.last_used) {
-				last_used = 0;
-			}
-			//get the full cross_within limit:
-			init.last_cross = 0;
-
-			//(this is actually what the standard State() constructor already does)
-
-			tables.emplace_back();
-			tables.back().states.emplace_back(init);
-		}
-
-		for (uint32_t x = 0; x < image_width; ++x) {
-			
-			Table &prev = tables[x];
-			tables.emplace_back();
-			Table &next = tables[x+1];
-
-			std::unordered_map< State, uint32_t > next_index;
-			next_index.reserve(prev.states.size()*4);
-
-			auto set_next_froms = [&](bool assert_on_add) {
-				std::vector< std::vector< uint32_t > > next_froms;
-				next_froms.reserve(prev.states.size() * yarns_linear.size());
-
-				//account for already-indexed states:
-				next_froms.resize(next_index.size());
-
-				size_t total_froms = 0;
-
-				for (uint32_t s = 0; s < prev.states.size(); ++s) {
-					State const &state = prev.states[s];
-					if (print_state_table && !assert_on_add) std::cout << "" << s << ":" << state << " ->";
-					state.next_states(params, x, [&](uint32_t y, State const &next_state){
-						auto ret = next_index.emplace(next_state, next_index.size());
-						if (ret.second) {
-							assert(!assert_on_add);
-							next.states.emplace_back(next_state);
-							next_froms.emplace_back();
-							assert(next.states.size() == next_index.size());
-							assert(next.states.size() == next_froms.size());
-						}
-						uint32_t to = ret.first->second;
-						assert(next.states.at(to) == next_state);
-
-						assert((to & STATE_MASK) == to); //state indices must be small enough to pack
-						next_froms.at(to).emplace_back((y << YARN_SHIFT) | (s & STATE_MASK));
-						total_froms += 1;
-
-						if (print_state_table && !assert_on_add) std::cout << " " << to << ":" << next_state;
-					});
-					if (print_state_table && !assert_on_add) std::cout << std::endl;
-				}
-#if 0
-				if (print_state_table && assert_on_add) {
-					std::cout << "---- optimal perm (for figure) ---" << std::endl;
-					assert(prev.states.size() == next.states.size());
-					std::vector< uint32_t > test_position;
-					test_position.reserve(prev.states.size());
-					for (uint32_t i = 0; i < prev.states.size(); ++i) {
-						test_position.emplace_back(i);
-					}
-					std::vector< uint32_t > best_position;
-					uint32_t best_cost = -1U;
-					do {
-					/*
-						bool symmetric = true;
-						for (uint32_t to = 0; to < next_froms.size(); ++to) {
-							State s = next.states.at(to);
-						}
-						*/
-						uint32_t test_cost = 0;
-						for (uint32_t to = 0; to < next_froms.size(); ++to) {
-							for (auto const &from_ : next_froms[to]) {
-								uint32_t from = from_ & STATE_MASK;
-								int32_t d = int32_t(test_position.at(to)) - int32_t(test_position.at(from));
-								test_cost += d*d;
-							}
-						}
-						if (test_cost < best_cost) {
-							best_cost = test_cost;
-							best_position = test_position;
-						}
-					} while (std::next_permutation(test_position.begin(), test_position.end()));
-
-					std::cout << "best cost: " << best_cost << std::endl;
-					for (uint32_t s = 0; s < prev.states.size(); ++s) {
-						State const &state = prev.states[s];
-						std::cout << "" << best_position.at(s) << ":" << state << " ->";
-						state.next_states(params, x, [&](uint32_t y, State const &next_state){
-							auto ret = next_index.emplace(next_state, next_index.size());
-							assert(!ret.second);
-							uint32_t to = ret.first->second;
-							assert(next.states.at(to) == next_state);
-							std::cout << " " << best_position.at(to) << ":" << next_state;
-						});
-						std::cout << std::endl;
-					}
-
-				}
-#endif				
-
-				//collapse next_froms into a nice compact two-array format:
-				assert(next.first_from.empty());
-				assert(next.froms.empty());
-				next.first_from.reserve(next.states.size() + 1);
-				next.froms.reserve(total_froms);
-
-				for (uint32_t to = 0; to < next.states.size(); ++to) {
-					next.first_from.emplace_back(next.froms.size());
-
-					next.froms.insert(next.froms.end(), next_froms[to].begin(), next_froms[to].end());
-
-					//PARANOIA: they do always get added in order, right?
-					for (uint32_t i = 0; i + 1 < next_froms[to].size(); ++i) {
-						assert(next_froms[to][i] < next_froms[to][i+1]);
-					}
-
-				}
-				next.first_from.emplace_back(next.froms.size());
-
-				assert(next.froms.size() == total_froms);
-				assert(next.first_from.size() == next.states.size() + 1);
-			};
-
-			//build the next states with whatever indices:
-			set_next_froms(false);
-
-			std::cout << "Table size at " << x << " is " << next.states.size() << std::endl;
-
-			//if prev and next have the same states, set them up to have the same indices.
-			//now the last table can loop with itself.
-			if (prev.states.size() == next.states.size()) {
-				std::unordered_set< State > prev_states(prev.states.begin(), prev.states.end());
-				std::unordered_set< State > next_states(next.states.begin(), next.states.end());
-				if (prev_states == next_states) {
-					std::cout << "  this is the last table." << std::endl;
-					//re-index this state:
-					next_index.clear();
-					next.states = prev.states;
-					next_index.reserve(next.states.size());
-					for (uint32_t to = 0; to < next.states.size(); ++to) {
-						next_index[next.states[to]] = to;
-					}
-
-					next.first_from.clear();
-					next.froms.clear();
-
-					set_next_froms(true);
-
-					break;
-				}
-			}
-
+		built_tables = get_tables(params, &job_queue);
+		#else
+		built_tables = get_tables(params, nullptr);
+		#endif
+		if (params.packed_froms) pack_froms(&built_tables);
+	}
+	Tables const &tables = (params.tables ? *params.tables : built_tables);
+	assert(tables.packed() == params.packed_froms);
+
+	//with params.search == "astar", rows are searched best-first along a "push"-style copy of the transitions, visiting at most search_limit (state, column) pairs:
+	assert(params.search == "dp" || params.search == "astar");
+	std::vector< uint32_t > first_to;
+	std::vector< uint32_t > tos;
+	uint64_t search_limit = params.search_limit;
+	//rows in a row that the search gave up on (after MaxSearchFallbacks, the rest of the image just does the forward pass):
+	constexpr uint32_t MaxSearchFallbacks = 4;
+	std::atomic< uint32_t > search_fallbacks{0};
+	if (params.search == "astar") {
+		push_transitions(tables, &first_to, &tos);
+		uint64_t forward_pairs = 0;
+		for (uint32_t x = 0; x <= image_width; ++x) {
+			forward_pairs += tables.column_states(x);
 		}
+		//a search visit measured at roughly 50x the cost of a forward-pass pair, so this keeps a search that gives up to about 5% of a forward pass:
+		// (but always leaves room for a few pairs per column, since even an easy row visits every column)
+		if (search_limit == 0) search_limit = std::max< uint64_t >(forward_pairs / 1000, 4 * uint64_t(image_width + 1) * yarns_linear.size());
+		log << "Searching rows best-first, falling back to the forward pass past " << search_limit << " of its " << forward_pairs << " (state, column) pairs." << std::endl;
+	}
 
-		auto after = std::chrono::high_resolution_clock::now();
-		std::cout << "Built " << tables.size() << " transition tables in " << std::chrono::duration< double >(after - before).count() * 1000.0 << "ms." << std::endl;
+	std::string pull_costs_name;
+	PullCostsFn pull_costs_fn = get_pull_costs(tables, params.pull_kernel, params.backpointers, &pull_costs_name);
+	if (!pull_costs_fn) {
+		std::cerr << "ERROR: pull kernel '" << params.pull_kernel << "' isn't supported here (with the " << (tables.packed() ? "packed" : "flat") << " froms layout)." << std::endl;
+		exit(1);
 	}
+	log << "Using the '" << pull_costs_name << "' version of pull_costs." << std::endl;
 
 	#if 0
 		//TODO: do some sort of froms reporting on the tables like this mayhap:
@@ -334,9 +123,9 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 
 			assert(state_first_from.size() == max_states + 1);
 
-			std::cout << "Total froms: " << state_froms.size() << " of a possible " << max_states * yarns_linear.size() << std::endl;
+			log << "Total froms: " << state_froms.size() << " of a possible " << max_states * yarns_linear.size() << std::endl;
 
-			std::cout << "Most froms was " << most_froms << "; largest range spanned " << largest_range << ", average " << average_range / double(max_states) << std::endl;
+			log << "Most froms was " << most_froms << "; largest range spanned " << largest_range << ", average " << average_range / double(max_states) << std::endl;
 		};
 
 	#endif 
@@ -345,51 +134,361 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 	auto before_dither = std::chrono::high_resolution_clock::now();
 
 	//store dithered image here (as selected yarn indices):
-	std::vector< uint8_t > dithered;
-	dithered.reserve(image_width * image_height);
+	std::vector< uint8_t > dithered(image_width * image_height);
+
+	//rows only depend on each other through error diffusion, so without it several rows are dithered at once,
+	// each by one thread with its own DP storage (the tables are shared):
+	uint32_t row_lanes = 1;
+	#ifdef USE_THREADS
+	if (!params.diffuse) row_lanes = std::max< uint32_t >(1, std::min< uint32_t >(job_queue.workers.size(), image_height));
+	if (row_lanes > 1) log << "Without error diffusion, dithering " << row_lanes << " rows at once." << std::endl;
+	#endif //USE_THREADS
 
 	#ifdef USE_THREADS
 
-	//NOTE: 'froms' isn't used on the first table, so don't divide it:
-	for (uint32_t t = 1; t < tables.size(); ++t) {
-		Table &table = tables[t];
+	//with the 'team' threading, a persistent team of threads steps through the columns together (see ThreadTeam.hpp);
+	// with 'queue', every column queues jobs on job_queue and waits for them:
+	std::unique_ptr< ThreadTeam > team;
+	if (params.threading == "team" && row_lanes == 1) team = std::make_unique< ThreadTeam >(params.max_threads, log);
+	uint32_t const threads = (team ? team->size() : job_queue.workers.size());
+
+	//try to give each worker about the same number of 'froms' to deal with:
+	// worker_first_to[0] splits the steady states (with their steady froms), worker_first_to[1] splits all states (with all froms)
+	std::vector< std::vector< uint32_t > > worker_first_to(2);
+
+	for (uint32_t t = 0; t < 2; ++t) {
+		uint32_t const states = (t == 0 ? tables.steady_states : tables.states.size());
+		auto froms_end = [&](uint32_t to) { return t == 0 ? tables.steady_froms_end[to] : tables.first_from[to+1]; };
+		uint32_t total_froms = 0;
+		for (uint32_t to = 0; to < states; ++to) {
+			total_froms += froms_end(to) - tables.first_from[to];
+		}
 
 		//this is a heuristic -- running with too little work per thread just makes things slower because of synchronization delays;
-		// so make sure each thread has at least 10000 froms to process.
-		uint32_t divisions = std::max< uint32_t >(1, std::min< uint32_t >(job_queue.workers.size(), table.froms.size() / 10000) );
+		// so make sure each thread has at least 10000 froms to process (or 1000 with a team, since its barrier is much cheaper than a queue round-trip).
+		uint32_t divisions = std::max< uint32_t >(1, std::min< uint32_t >(threads, total_froms / (team ? 1000 : 10000)) );
 
 		if (params.max_threads != 0) {
 			divisions = std::min(divisions, params.max_threads);
 		}
 
-		table.worker_first_to.emplace_back(0);
+		worker_first_to[t].emplace_back(0);
 		uint32_t worker_froms = 0;
-		for (uint32_t to = 0; to < table.states.size(); ++to) {
-			uint32_t froms_begin = table.first_from.at(to);
-			uint32_t froms_end = table.first_from.at(to+1);
-			worker_froms += froms_end - froms_begin;
-			if (worker_froms >= table.froms.size() / divisions || to + 1 == table.states.size()) {
-				//std::cout << " Worker " << worker_first_to.size() << " will do [" << worker_first_to.back() << ", " << to+1 << ") -- " << worker_froms << " froms." << std::endl;
-				table.worker_first_to.emplace_back(to+1);
+		for (uint32_t to = 0; to < states; ++to) {
+			uint32_t froms_begin = tables.first_from[to];
+			worker_froms += froms_end(to) - froms_begin;
+			if (worker_froms >= total_froms / divisions || to + 1 == states) {
+				//std::cout << " Worker " << worker_first_to[t].size() << " will do [" << worker_first_to[t].back() << ", " << to+1 << ") -- " << worker_froms << " froms." << std::endl;
+				worker_first_to[t].emplace_back(to+1);
 				worker_froms = 0;
 			}
 		}
-		//std::cout << "[table " << (&table - &tables[0]) << "] Dividing " << table.froms.size() << " state froms over " << divisions << " threads." << std::endl;
+		//std::cout << "[split " << t << "] Dividing " << total_froms << " state froms over " << divisions << " threads." << std::endl;
 	}
 
 	#endif //USE_THREADS
 
-	std::mt19937 mt(params.seed);
+	//DP storage, allocated once (sized by the tables) for each row lane and reused for every row:
+	// min_costs[x] (and backs[x]) are the states that can appear before column x
+	// if storing every column would go over params.memory_budget, only every 'checkpoint'th column (and the last) gets its own storage;
+	//  the columns in between share checkpoint-1 slots (column x uses slot x % checkpoint - 1), and readback refills them as needed
+	//  by re-running the forward pass from the checkpoint before them (which gives exactly the same costs)
+	uint32_t checkpoint = 0; //0 means every column has its own storage
+	auto is_checkpoint = [&](uint32_t x) {
+		return checkpoint == 0 || x % checkpoint == 0 || x == image_width;
+	};
+	//(state, column) pairs reached by the best-first search, and entries in its queue:
+	struct SearchNode {
+		uint32_t state;
+		uint32_t x;
+		Cost cost; //lowest cost found so far to reach 'state' before column x
+	};
+	struct SearchEntry {
+		double bound; //lower bound on the cost of any row through the node (given the cost below)
+		uint32_t x;
+		uint32_t node;
+		Cost cost; //the node's cost when this was queued (if it has dropped since, this entry is stale)
+	};
+	struct RowStorage {
+		std::vector< Cost > min_cost_storage;
+		std::vector< std::span< Cost > > min_costs;
+		std::vector< uint32_t > back_storage;
+		std::vector< std::span< uint32_t > > backs;
+		std::vector< Cost > yarn_costs; //cost of each yarn at each column of the current row
+
+		//best-first search storage:
+		std::vector< SearchNode > search_nodes;
+		std::vector< uint32_t > search_slots; //node + 1 for each used slot, 0 for empty ones; size is a power of two (or zero)
+		std::vector< SearchEntry > search_queue; //a heap (see search_row)
+		std::vector< double > search_bound; //lower bound on the cost of finishing the row from each column
+		std::vector< double > search_cheapest_sum; //sum of the cheapest yarn costs of the columns before each column
+		std::vector< double > search_extra; //least extra each yarn costs over the cheapest in each window (see search_row)
+
+		//readback storage:
+		std::vector< uint32_t > possible_lowest;
+		std::vector< uint32_t > path;
+		std::vector< uint8_t > path_yarns; //yarn used at each column (read from the 'froms' entry used to step back along the path)
+		std::vector< uint32_t > best_froms; //as (yarn << YARN_SHIFT) | from
+	};
+	std::vector< RowStorage > row_storage(row_lanes);
+	{
+		//states stored with checkpoint interval k, and where each column's storage starts:
+		auto layout = [&](uint32_t k, std::vector< size_t > *column_offset) -> size_t {
+			std::vector< uint32_t > slot_states(k == 0 ? 0 : k-1, 0);
+			size_t total = 0;
+			for (uint32_t x = 0; x <= image_width; ++x) {
+				if (k == 0 || x % k == 0 || x == image_width) {
+					if (column_offset) column_offset->emplace_back(total);
+					total += tables.column_states(x);
+				} else {
+					if (column_offset) column_offset->emplace_back(-1ULL); //(filled in below)
+					slot_states[x % k - 1] = std::max(slot_states[x % k - 1], tables.column_states(x));
+				}
+			}
+			std::vector< size_t > slot_offset;
+			for (uint32_t s : slot_states) {
+				slot_offset.emplace_back(total);
+				total += s;
+			}
+			if (column_offset) {
+				for (uint32_t x = 0; x <= image_width; ++x) {
+					if ((*column_offset)[x] == -1ULL) (*column_offset)[x] = slot_offset[x % k - 1];
+				}
+			}
+			return total;
+		};
+
+		size_t bytes_per_state = sizeof(Cost) + (params.backpointers ? sizeof(uint32_t) : 0);
+		size_t budget = size_t(params.memory_budget) * 1024 * 1024 / row_lanes; //(each lane gets an equal share)
+		if (budget != 0 && layout(0, nullptr) * bytes_per_state > budget) {
+			//use the interval that needs the least storage (somewhere around sqrt(image_width)):
+			size_t least = layout(0, nullptr);
+			for (uint32_t k = 2; k < image_width; ++k) {
+				size_t states = layout(k, nullptr);
+				if (states < least) {
+					least = states;
+					checkpoint = k;
+				}
+			}
+			if (least * bytes_per_state > budget) {
+				log << "WARNING: DP storage will not fit in the memory budget of " << params.memory_budget << "MB; using as little as possible." << std::endl;
+			}
+			if (checkpoint != 0) {
+				log << "Checkpointing every " << checkpoint << " columns to fit the memory budget (readback will re-compute the columns in between)." << std::endl;
+			}
+		}
 
-	uint32_t random_choices = 0;
+		std::vector< size_t > column_offset;
+		size_t total_states = layout(checkpoint, &column_offset);
+		assert(column_offset.size() == image_width + 1);
+
+		for (RowStorage &storage : row_storage) {
+			storage.min_cost_storage.resize(total_states);
+			if (params.backpointers) storage.back_storage.resize(total_states);
 
+			storage.min_costs.reserve(image_width + 1);
+			if (params.backpointers) storage.backs.reserve(image_width + 1);
+			for (uint32_t x = 0; x <= image_width; ++x) {
+				assert(column_offset[x] + tables.column_states(x) <= total_states);
+				storage.min_costs.emplace_back(storage.min_cost_storage.data() + column_offset[x], tables.column_states(x));
+				if (params.backpointers) storage.backs.emplace_back(storage.back_storage.data() + column_offset[x], tables.column_states(x));
+			}
+
+			storage.yarn_costs.resize(image_width * yarns_linear.size());
+			storage.path.reserve(image_width+1);
+			storage.path_yarns.reserve(image_width);
+			storage.best_froms.reserve(yarns_linear.size());
+		}
+
+		log << "Allocated " << row_lanes * total_states * bytes_per_state / (1024.0 * 1024.0) << "MB of DP storage." << std::endl;
+	}
 
 	//---- per-row ----
-	Cost total_cost{0};
-	for (uint32_t row = 0; row < image_height; ++row) {
+	std::vector< Cost > row_costs(image_height, Cost{0});
+	std::vector< uint32_t > row_random_choices(image_height, 0);
+	std::vector< double > row_forward_ms(image_height, 0.0); //time spent computing min_costs (for per-column timing report)
+
+	//index of the search node for 'state' before column x, or -1U if the search didn't reach it:
+	auto search_slot = [](uint32_t x, uint32_t state) -> uint32_t {
+		return (state * 0x9e3779b1u) ^ (x * 0x85ebca6bu);
+	};
+	auto search_find = [&](RowStorage const &storage, uint32_t x, uint32_t state) -> uint32_t {
+		std::vector< uint32_t > const &slots = storage.search_slots;
+		if (slots.empty()) return -1U;
+		uint32_t const mask = slots.size() - 1;
+		for (uint32_t i = search_slot(x, state) & mask; slots[i] != 0; i = (i + 1) & mask) {
+			SearchNode const &node = storage.search_nodes[slots[i] - 1];
+			if (node.state == state && node.x == x) return slots[i] - 1;
+		}
+		return -1U;
+	};
+	//index of the search node for 'state' before column x, adding it (with an infinite cost) if the search hasn't reached it:
+	auto search_insert = [&](RowStorage &storage, uint32_t x, uint32_t state) -> uint32_t {
+		std::vector< uint32_t > &slots = storage.search_slots;
+		std::vector< SearchNode > &nodes = storage.search_nodes;
+		if (2 * (nodes.size() + 1) > slots.size()) {
+			//grow (keeping the load factor under a half):
+			slots.assign(std::max< size_t >(1024, 2 * slots.size()), 0);
+			uint32_t const mask = slots.size() - 1;
+			for (uint32_t n = 0; n < nodes.size(); ++n) {
+				uint32_t i = search_slot(nodes[n].x, nodes[n].state) & mask;
+				while (slots[i] != 0) i = (i + 1) & mask;
+				slots[i] = n + 1;
+			}
+		}
+		uint32_t const mask = slots.size() - 1;
+		uint32_t i = search_slot(x, state) & mask;
+		for (; slots[i] != 0; i = (i + 1) & mask) {
+			SearchNode const &node = nodes[slots[i] - 1];
+			if (node.state == state && node.x == x) return slots[i] - 1;
+		}
+		slots[i] = nodes.size() + 1;
+		nodes.emplace_back(SearchNode{state, x, std::numeric_limits< Cost >::infinity()});
+		return nodes.size() - 1;
+	};
+
+	//best-first (A*) search for a row's cheapest cost, instead of the forward pass:
+	// the queue is ordered by cost so far plus a lower bound on the cost of finishing the row from the state:
+	//  - every column costs at least its cheapest yarn;
+	//  - (with use_within) yarns used at different columns in a window cost at least the sum of its columns' cheapest yarns plus,
+	//    for each of those yarns, the least extra it costs over the cheapest at any column in the window. every window of use_within
+	//    columns uses every yarn, which gives search_bound[x] (for the rest of the row from column x, whatever the state);
+	//    and the state says by when each yarn must next be used, which gives a tighter bound for the next use_within columns.
+	// the bound is shrunk a little to cover float rounding, so it is never more than the (rounded) sums the forward pass makes.
+	// searching goes on until every queued bound is over the cheapest cost found, so every state on *any* cheapest path ends up with
+	// exactly the cost the forward pass would give it -- which is all readback looks at, so it picks exactly the same path.
+	// returns false to fall back to the forward pass (after visiting more than search_limit pairs, or for costs the bound can't handle).
+	auto search_row = [&](RowStorage &storage) -> bool {
+		std::vector< Cost > const &yarn_costs = storage.yarn_costs;
+		uint32_t const yarns = yarns_linear.size();
+		for (uint32_t i = 0; i < image_width * yarns; ++i) {
+			if (!(yarn_costs[i] >= 0 && yarn_costs[i] < std::numeric_limits< Cost >::infinity())) return false; //(the bound needs finite, non-negative costs)
+		}
+
+		uint32_t const window = params.use_within;
+
+		std::vector< double > &cheapest_sum = storage.search_cheapest_sum;
+		cheapest_sum.assign(image_width + 1, 0.0);
+		for (uint32_t x = 0; x < image_width; ++x) {
+			cheapest_sum[x+1] = cheapest_sum[x] + *std::min_element(yarn_costs.begin() + x * yarns, yarn_costs.begin() + (x + 1) * yarns);
+		}
+		auto cheapest = [&](uint32_t x) -> double {
+			return cheapest_sum[x+1] - cheapest_sum[x];
+		};
+		//extra[(x * yarns + y) * window + (length-1)] is the least extra yarn y costs at any column in [x, x+length):
+		std::vector< double > &extra = storage.search_extra;
+		extra.assign(size_t(image_width) * yarns * window, std::numeric_limits< double >::infinity());
+		for (uint32_t x = 0; x < image_width; ++x) {
+			for (uint32_t y = 0; y < yarns; ++y) {
+				double *at = extra.data() + (size_t(x) * yarns + y) * window;
+				for (uint32_t i = 0; i < window && x + i < image_width; ++i) {
+					at[i] = std::min(i == 0 ? std::numeric_limits< double >::infinity() : at[i-1], yarn_costs[(x+i) * yarns + y] - cheapest(x+i));
+				}
+			}
+		}
+
+		std::vector< double > &bound = storage.search_bound;
+		bound.assign(image_width + 1, 0.0);
+		for (uint32_t x = image_width - 1; x < image_width; --x) {
+			bound[x] = cheapest(x) + bound[x+1];
+			if (window != 0 && x + window <= image_width) {
+				double window_bound = bound[x + window] + cheapest_sum[x + window] - cheapest_sum[x];
+				for (uint32_t y = 0; y < yarns; ++y) {
+					window_bound += extra[(size_t(x) * yarns + y) * window + (window-1)];
+				}
+				bound[x] = std::max(bound[x], window_bound);
+			}
+		}
+		//lower bound on the cost of finishing the row from 'state' before column x:
+		auto state_bound = [&](uint32_t x, uint32_t state) -> double {
+			if (window == 0 || x == image_width) return bound[x];
+			//yarns that must be used before the end of the row, each at a different column of [x, x+span):
+			uint32_t const span = std::min(window, image_width - x);
+			double forced = bound[x + span] + cheapest_sum[x + span] - cheapest_sum[x];
+			State const &s = tables.states[state];
+			for (uint32_t y = 0; y < yarns; ++y) {
+				//(a yarn last used 'count' columns ago must be used again within use_within + 1 - count columns; an unused yarn by column use_within - 1)
+				uint32_t count = s.last_used[y];
+				uint32_t length = (count != 0 ? window + 1 - count : window - x);
+				assert(length >= 1 && length <= window);
+				if (length <= span) forced += extra[(size_t(x) * yarns + y) * window + (length-1)];
+			}
+			return std::max(bound[x], forced);
+		};
+		//lower bound on any row through 'state' before column x with 'cost' so far:
+		// (each float addition left rounds down by at most a factor of (1 - 2^-24); the rest of the 2^-23 per column covers the double sums)
+		auto row_bound = [&](Cost cost, uint32_t x, uint32_t state) -> double {
+			return (double(cost) + state_bound(x, state)) * (1.0 - (image_width - x + 2) * 0x1p-23);
+		};
+
+		std::vector< SearchNode > &nodes = storage.search_nodes;
+		std::vector< SearchEntry > &queue = storage.search_queue;
+		nodes.clear();
+		queue.clear();
+		std::fill(storage.search_slots.begin(), storage.search_slots.end(), 0);
+
+		//(lowest bound first; ties go to later columns, then to earlier nodes, so the order only depends on the costs)
+		auto later = [](SearchEntry const &a, SearchEntry const &b) {
+			if (a.bound != b.bound) return a.bound > b.bound;
+			if (a.x != b.x) return a.x < b.x;
+			return a.node > b.node;
+		};
+		auto reach = [&](uint32_t x, uint32_t state, Cost cost) {
+			uint32_t node = search_insert(storage, x, state);
+			if (cost < nodes[node].cost) {
+				nodes[node].cost = cost;
+				queue.emplace_back(SearchEntry{row_bound(cost, x, state), x, node, cost});
+				std::push_heap(queue.begin(), queue.end(), later);
+			}
+		};
+
+		//first states get cost zero:
+		for (uint32_t s = 0; s < tables.column_states(0); ++s) {
+			if (tables.is_reachable(0, s)) reach(0, s, Cost{0});
+		}
+
+		Cost best = std::numeric_limits< Cost >::infinity();
+		while (!queue.empty()) {
+			std::pop_heap(queue.begin(), queue.end(), later);
+			SearchEntry const entry = queue.back();
+			queue.pop_back();
+			if (entry.bound > best) break; //(every row through the rest of the queue costs more than the cheapest found)
+			SearchNode const node = nodes[entry.node];
+			if (entry.cost != node.cost) continue; //(stale)
+			if (node.x == image_width) {
+				best = std::min(best, node.cost);
+				continue;
+			}
+			for (uint32_t t = first_to[node.state]; t < first_to[node.state+1]; ++t) {
+				uint32_t const to = tos[t] & STATE_MASK;
+				uint32_t const y = tos[t] >> YARN_SHIFT;
+				if (!tables.is_reachable(node.x+1, to)) continue; //(transition isn't valid at this column)
+				reach(node.x + 1, to, node.cost + yarn_costs[node.x * yarns + y]);
+			}
+			if (nodes.size() > search_limit) return false;
+		}
+		return best != std::numeric_limits< Cost >::infinity();
+	};
+
+	//dither one row using 'storage', with progress going to 'out':
+	auto dither_row = [&](uint32_t row, RowStorage &storage, std::ostream &out) {
+		std::vector< std::span< Cost > > const &min_costs = storage.min_costs;
+		std::vector< std::span< uint32_t > > const &backs = storage.backs;
+		std::vector< Cost > &yarn_costs = storage.yarn_costs;
+		std::vector< uint32_t > &possible_lowest = storage.possible_lowest;
+		std::vector< uint32_t > &path = storage.path;
+		std::vector< uint8_t > &path_yarns = storage.path_yarns;
+		std::vector< uint32_t > &best_froms = storage.best_froms;
+
+		//every row gets its own random stream, so rows can be done in any order:
+		std::mt19937 mt;
+		if (params.seed >= 2) {
+			std::seed_seq seq{params.seed, row};
+			mt.seed(seq);
+		}
 
 		auto rv = [&](uint32_t max) -> uint32_t {
-			if (max > 1) random_choices += 1;
+			if (max > 1) row_random_choices[row] += 1;
 
 			if (params.seed == 0) return 0;
 			else if (params.seed == 1) return row % max;
@@ -399,173 +498,240 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 
 		auto before = std::chrono::high_resolution_clock::now();
 
-		std::cout << (row+1) << "/" << image_height << ":"; std::cout.flush();
+		out << (row+1) << "/" << image_height << ":"; out.flush();
 
-		assert(!tables.empty());
+		assert(tables.states.size() != 0);
 
 		//store min cost to every state: (will be used for backtracking later)
-		std::vector< std::vector< Cost > > min_costs;
-		min_costs.reserve(image_width + 1);
+		//states start at inf and will be computed via min (unreachable states stay at inf):
+		std::fill(min_costs[0].begin(), min_costs[0].end(), std::numeric_limits< Cost >::infinity());
 
 		//first states get cost zero:
-		min_costs.emplace_back(tables[0].states.size(), Cost{0});
-
-		//remaining states start at inf and will be computed via min:
-		for (uint32_t x = 0; x < image_width; ++x) {
-			Table const &next = tables[std::min< uint32_t >(x + 1, tables.size()-1)];
-			min_costs.emplace_back(next.states.size(), std::numeric_limits< Cost >::infinity());
+		for (uint32_t s = 0; s < min_costs[0].size(); ++s) {
+			if (tables.is_reachable(0, s)) min_costs[0][s] = Cost{0};
 		}
+
+		//(if params.backpointers, backs[x] also gets set for every state that can appear before column x; see pull_costs.hpp)
 		assert(min_costs.size() == image_width + 1);
 
+		//(pre-)compute the costs of using each yarn at each column:
+		difference_batch(image_linear.data() + row*image_width, image_width, yarn_costs.data());
 
-		for (uint32_t x = 0; x < image_width; ++x) { //for each column of the image:
-			std::vector< Cost > yarn_costs;
-			yarn_costs.reserve(yarns_linear.size());
-			{ // (pre-)compute the costs of using each yarn here:
-				Color::Linear px_color = image_linear[row*image_width+x];
-				for (uint32_t y = 0; y < yarns_linear.size(); ++y) {
-					Color::Linear yarn_color = yarns_linear[y];
-					yarn_costs.emplace_back( difference(px_color, yarn_color) );
-				}
-			}
-			assert(yarn_costs.size() == yarns_linear.size());
-
-			Table const &prev = tables[std::min< uint32_t >(x, tables.size()-1)];
-			Table const &next = tables[std::min< uint32_t >(x + 1, tables.size()-1)];
-
-			#define PULL_VERSION
-			#ifdef PULL_VERSION
-			//"Pull version"
-			//for every next state, pull cost forward
-			{
-				std::vector< Cost > const &prev_min_costs = min_costs.at(x);
-				std::vector< Cost > &next_min_costs = min_costs.at(x+1);
-
-				assert(prev_min_costs.size() == prev.states.size());
-				assert(next_min_costs.size() == next.states.size());
-
-				auto pull_costs = [&](uint32_t to_begin, uint32_t to_end){
-					for (uint32_t to = to_begin; to < to_end; ++to) {
-						uint32_t const *froms_begin = next.froms.data() + next.first_from[to];
-						uint32_t const *froms_end = next.froms.data() + next.first_from[to+1];
-						assert(froms_begin <= next.froms.data() + next.froms.size());
-
-						Cost &next_min_cost = next_min_costs[to];
-						for (uint32_t const *yarn_from = froms_begin; yarn_from != froms_end; ++yarn_from) {
-							uint8_t y = *yarn_from >> YARN_SHIFT;
-							uint32_t from = *yarn_from & STATE_MASK;
-							Cost test_cost = prev_min_costs[from] + yarn_costs[y];
-							if (test_cost < next_min_cost) {
-								next_min_cost = test_cost;
-							}
-						}
-					}
-				};
+		//"Pull version"
+		//for every next state in [to_begin, to_end), pull cost forward from column x:
+		auto pull_costs = [&](uint32_t x, uint32_t to_begin, uint32_t to_end) {
+			std::span< Cost const > prev_min_costs = min_costs[x];
+			std::span< Cost > next_min_costs = min_costs[x+1];
 
+			assert(prev_min_costs.size() == tables.column_states(x));
+			assert(next_min_costs.size() == tables.column_states(x+1));
 
-				#ifdef USE_THREADS
-				if (next.worker_first_to.size() <= 2) {
-				#endif //USE_THREADS
-					pull_costs(0, next_min_costs.size());
-				#ifdef USE_THREADS
-				} else {
-					for (uint32_t w = 1; w < next.worker_first_to.size(); ++w) {
-						uint32_t begin = next.worker_first_to[w-1];
-						uint32_t end = next.worker_first_to[w];
-						job_queue.run([&pull_costs,begin,end](){
-							pull_costs(begin, end);
-						});
-					}
-					job_queue.wait();
-				}
-				#endif //USE_THREADS
+			to_end = std::min< uint32_t >(to_end, next_min_costs.size()); //(the last warm-up column only moves into steady states)
+			if (to_begin >= to_end) return;
+
+			//(next column may share storage with an earlier one, so start it over at inf)
+			std::fill(next_min_costs.begin() + to_begin, next_min_costs.begin() + to_end, std::numeric_limits< Cost >::infinity());
+			pull_costs_fn(tables, x, prev_min_costs.data(), yarn_costs.data() + x * yarns_linear.size(), next_min_costs.data(), (backs.empty() ? nullptr : backs[x+1].data()), to_begin, to_end);
+		};
 
+		#ifdef USE_THREADS
+		//member's share of the work of stepping from column x (with the team, member m does every threads'th split):
+		auto team_pull_costs = [&](uint32_t member, uint32_t x) {
+			std::vector< uint32_t > const &next_first_to = worker_first_to[tables.steady(x) ? 0 : 1];
+			for (uint32_t w = member + 1; w < next_first_to.size(); w += team->size()) {
+				pull_costs(x, next_first_to[w-1], next_first_to[w]);
 			}
-			#endif //PULL_VERSION
+		};
+		#endif //USE_THREADS
 
-		}
+		//compute min_costs[x+1] (and backs[x+1]) from min_costs[x]:
+		// (also used by readback to re-compute the columns between checkpoints)
+		auto step = [&](uint32_t x) {
+			#ifdef USE_THREADS
+			std::vector< uint32_t > const &next_first_to = worker_first_to[tables.steady(x) ? 0 : 1];
+			if (row_lanes > 1 || next_first_to.size() <= 2) { //(with several rows at once, each row gets one thread)
+			#endif //USE_THREADS
+				pull_costs(x, 0, min_costs[x+1].size());
+			#ifdef USE_THREADS
+			} else if (team) {
+				team->run([&](uint32_t member){
+					team_pull_costs(member, x);
+				});
+			} else {
+				for (uint32_t w = 1; w < next_first_to.size(); ++w) {
+					uint32_t begin = next_first_to[w-1];
+					uint32_t end = next_first_to[w];
+					job_queue.run([&pull_costs,x,begin,end](){
+						pull_costs(x, begin, end);
+					});
+				}
+				job_queue.wait();
+			}
+			#endif //USE_THREADS
+		};
 
-		if (min_costs.at(image_width).empty()) {
-			std::cerr << " ERROR: no valid dither exists." << std::endl;
-			exit(1);
+		//try the best-first search, if asked to (readback then reads its costs instead of min_costs):
+		bool const try_search = (params.search == "astar" && search_fallbacks.load(std::memory_order_relaxed) < MaxSearchFallbacks);
+		bool const searched = (try_search && search_row(storage));
+		uint32_t fallbacks = 0;
+		if (searched) search_fallbacks.store(0, std::memory_order_relaxed);
+		else if (try_search) fallbacks = search_fallbacks.fetch_add(1, std::memory_order_relaxed) + 1;
+
+		#ifdef USE_THREADS
+		if (searched) {
+			//(no forward pass needed)
+		} else if (team && (worker_first_to[0].size() > 2 || worker_first_to[1].size() > 2)) {
+			//the team steps through the whole row together, with a barrier after each column:
+			team->run([&](uint32_t member){
+				for (uint32_t x = 0; x < image_width; ++x) {
+					team_pull_costs(member, x);
+					team->barrier();
+				}
+			});
+		} else
+		#endif //USE_THREADS
+		if (!searched) {
+			for (uint32_t x = 0; x < image_width; ++x) { //for each column of the image:
+				step(x);
+			}
 		}
 
 		auto before_readback = std::chrono::high_resolution_clock::now();
 
+		//lowest cost found to state s before column x, by whichever pass was used:
+		// (after a search, this is only the same as min_costs would be for states on cheapest paths; others may be higher or inf)
+		auto reached_cost = [&](uint32_t x, uint32_t s) -> Cost {
+			if (!searched) return min_costs[x][s];
+			uint32_t node = search_find(storage, x, s);
+			return (node == -1U ? std::numeric_limits< Cost >::infinity() : storage.search_nodes[node].cost);
+		};
+
 		//Now read off a minimum-cost path to the end state:
 		{
-			std::vector< uint32_t > possible_lowest;
-			possible_lowest.emplace_back(0);
-			for (uint32_t s = 1; s < min_costs[image_width].size(); ++s) {
-				assert(!possible_lowest.empty());
+			possible_lowest.clear();
+			for (uint32_t s = 0; s < tables.column_states(image_width); ++s) {
+				Cost cost = reached_cost(image_width, s);
+				if (cost == std::numeric_limits< Cost >::infinity()) continue; //(not reachable)
 
-				if (min_costs[image_width][s] < min_costs[image_width][possible_lowest[0]]) {
+				if (possible_lowest.empty() || cost < reached_cost(image_width, possible_lowest[0])) {
 					possible_lowest.clear();
 					possible_lowest.emplace_back(s);
-				} else if (min_costs[image_width][s] == min_costs[image_width][possible_lowest[0]]) {
+				} else if (cost == reached_cost(image_width, possible_lowest[0])) {
 					possible_lowest.emplace_back(s);
 				}
 			}
-			assert(!possible_lowest.empty());
+			if (possible_lowest.empty()) {
+				std::cerr << " ERROR: no valid dither exists." << std::endl;
+				exit(1);
+			}
 
 			//std::cout << "Have " << possible_lowest.size() << " same-cost ending states." << std::endl;
 
 			uint32_t lowest = possible_lowest[rv(possible_lowest.size())];
 
-			std::cout << " cost " << min_costs[image_width][lowest]; std::cout.flush();
+			out << " cost " << reached_cost(image_width, lowest);
+			if (try_search) {
+				if (searched) out << " (searched " << storage.search_nodes.size() << " pairs)";
+				else out << " (search gave up; did the forward pass)";
+				if (fallbacks == MaxSearchFallbacks) out << " (" << fallbacks << " rows in a row gave up, so the rest won't be searched)";
+			}
+			out.flush();
 
 			uint32_t could_randomize = 0; //track when we might have a chance to do a random tiebreak between options
 
-			std::vector< uint32_t > path;
-			path.reserve(image_width+1);
+			path.clear();
 			path.emplace_back(lowest);
+
+			path_yarns.clear();
+
+			//if checkpointing, the shared slots hold the columns of the last segment computed:
+			uint32_t filled_segment = (checkpoint == 0 ? 0 : (image_width-1) / checkpoint);
+
 			for (uint32_t x = image_width-1; x < image_width; --x) {
-				Table const &prev = tables[std::min< uint32_t >(x, tables.size()-1)];
-				Table const &next = tables[std::min< uint32_t >(x+1, tables.size()-1)];
+				assert(path.back() < tables.column_states(x+1));
+
+				if (!searched && !is_checkpoint(x) && x / checkpoint != filled_segment) {
+					//re-compute the columns in this segment from the checkpoint at its start:
+					filled_segment = x / checkpoint;
+					for (uint32_t c = filled_segment * checkpoint; c < x; ++c) {
+						step(c);
+					}
+				}
+
+				if (!searched && !backs.empty()) {
+					//the forward pass remembered the first cheapest from and how many froms tied with it:
+					uint32_t back = backs[x+1][path.back()];
+					uint32_t first = tables.first_from[path.back()] + (back & BACK_OFFSET_MASK);
+					uint32_t end = tables.froms_end(x, path.back());
+					uint32_t ties = back >> BACK_TIES_SHIFT;
+					Cost best = min_costs[x][tables.froms[first] & STATE_MASK];
+					assert(best != std::numeric_limits< Cost >::infinity());
+					if (ties == BACK_TIES_MAX) { //(count saturated, so count again)
+						ties = 0;
+						for (uint32_t i = first; i < end; ++i) {
+							if (min_costs[x][tables.froms[i] & STATE_MASK] == best) ties += 1;
+						}
+					}
+					//same choice as the scan below would make -- the pick'th from that ties for cheapest:
+					uint32_t pick = rv(ties);
+					uint32_t yarn_from = tables.froms[first];
+					for (uint32_t i = first + 1; pick > 0; ++i) {
+						assert(i < end);
+						if (min_costs[x][tables.froms[i] & STATE_MASK] == best) {
+							yarn_from = tables.froms[i];
+							pick -= 1;
+						}
+					}
+					path.emplace_back( yarn_from & STATE_MASK );
+					path_yarns.emplace_back( yarn_from >> YARN_SHIFT );
+					if (ties > 1) could_randomize += 1;
+					continue;
+				}
 
 				Cost best = std::numeric_limits< Cost >::infinity();
-				std::vector< uint32_t > best_froms;
-				for (uint32_t i = next.first_from.at(path.back()); i < next.first_from.at(path.back()+1); ++i) {
-					uint32_t from = next.froms.at(i) & STATE_MASK;
-					assert(from < prev.states.size());
+				best_froms.clear();
+				for (uint32_t i = tables.first_from[path.back()]; i < tables.froms_end(x, path.back()); ++i) {
+					uint32_t from = tables.froms[i] & STATE_MASK;
 
-					Cost test = min_costs[x].at(from);
+					assert(from < tables.column_states(x));
+					Cost test = reached_cost(x, from);
+					if (test == std::numeric_limits< Cost >::infinity()) continue; //(not reachable)
 					if (test < best) {
 						best_froms.clear();
 						best = test;
 					}
 					if (test == best) {
-						best_froms.emplace_back(from);
+						best_froms.emplace_back(tables.froms[i]);
 					}
 				}
 				assert(!best_froms.empty());
-				path.emplace_back( best_froms[rv(best_froms.size())] );
+				uint32_t yarn_from = best_froms[rv(best_froms.size())];
+				path.emplace_back( yarn_from & STATE_MASK );
+				path_yarns.emplace_back( yarn_from >> YARN_SHIFT );
 				if (best_froms.size() > 1) could_randomize += 1;
 			}
 			std::reverse(path.begin(), path.end());
+			std::reverse(path_yarns.begin(), path_yarns.end());
 			assert(path.size() == image_width+1);
+			assert(path_yarns.size() == image_width);
 
 			//std::cout << " had " << could_randomize << " tied costs"; //DEBUG
 
 			Cost check_cost = 0.0;
 
 			for (uint32_t x = 0; x < image_width; ++x) {
-				Table const &prev = tables[std::min< uint32_t >(x, tables.size()-1)];
-				Table const &next = tables[std::min< uint32_t >(x+1, tables.size()-1)];
-
-				uint32_t s = path[x];
-				uint32_t s_next = path[x+1];
-
-				//read off what yarn was used in the state:
-				uint8_t y = 0xff;
-				prev.states.at(s).next_states(params, x, [&](uint32_t i, State const &next_state){
-					if (next_state == next.states.at(s_next)) {
-						assert(y == 0xff); //should only have one used yarn
-						y = i;
-					}
-				});
-				assert(y != 0xff); //should have at least one used yarn
-				dithered.emplace_back(y); //store in output
+				uint8_t y = path_yarns[x];
+
+				#ifndef NDEBUG
+				{ //PARANOIA: using the yarn really does step along the path:
+					State next_state(yarns_linear.size());
+					bool valid = tables.states.at(path[x]).next_state(params, x, y, &next_state);
+					assert(valid);
+					assert(next_state == tables.states.at(path[x+1]));
+				}
+				#endif
+
+				dithered[row * image_width + x] = y; //store in output
 				//std::cout << char('A' + y); std::cout.flush();
 
 				Color::Linear px_color = image_linear[row*image_width+x];
@@ -573,35 +739,40 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 				check_cost += difference(px_color, yarn_color);
 			}
 
+			#ifndef NDEBUG
+			{ //PARANOIA: the row really does meet the constraints:
+				DitherWindows windows = dither_windows(yarns_linear.size(), dithered.data() + row * image_width, image_width);
+				assert(params.use_within == 0 || windows.longest_no_use < params.use_within);
+				assert(params.cross_within == 0 || windows.longest_no_crossing < params.cross_within);
+			}
+			#endif
+
 			//apply error diffusion (if parameters say so):
 			error_diffusion(params, row, dithered, &image_linear);
 
 			//these should be *identical*, even given floating point rounding -- same numbers added in the same order:
-			assert(min_costs[image_width][lowest] == check_cost);
-
-			assert(dithered.size() == (row + 1) * image_width); //wrote enough pixels to the output, right?
-
+			assert(reached_cost(image_width, lowest) == check_cost);
 
-			//accumulate for later total cost display
-			total_cost += min_costs[image_width][lowest];
+			//remember for later total cost display
+			row_costs[row] = reached_cost(image_width, lowest);
 
 			/*
 			{ //PARANOIA: check max_float and max_crossing:
 				std::vector< uint32_t > last_used(yarns_linear.size(), 0); //how many needles since yarn use
 				uint32_t last_crossing = 0; //how many needles since a crossing
-				std::cout << "\n";
+				log << "\n";
 				for (uint32_t x = 0; x < image_width; ++x) {
 					uint8_t y = dithered[row * image_width + x];
 					assert(y < yarns_linear.size());
 
-					std::cout << x << ": " << char('a' + y) << " " << states[path[x]] << " -> ";
+					log << x << ": " << char('a' + y) << " " << states[path[x]] << " -> ";
 					for (uint32_t i = 0; i < yarns_linear.size(); ++i) {
 						uint32_t to = state_to[path[x] * yarns_linear.size() + i];
 						if (to != -1U) {
-							std::cout << " " << states[to];
+							log << " " << states[to];
 						}
 					}
-					std::cout << std::endl;
+					log << std::endl;
 
 					//increment last used position for all yarns:
 					for (uint32_t &u : last_used) u += 1;
@@ -613,12 +784,12 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 					//yarn used at this needle gets reset to zero:
 					last_used[y] = 0;
 
-					std::cout << "  calc: [";
+					log << "  calc: [";
 					for (uint32_t &u : last_used) {
-						if (&u != &last_used[0]) std::cout << ',';
-						std::cout << int(u);
+						if (&u != &last_used[0]) log << ',';
+						log << int(u);
 					}
-					std::cout << "]x" << int(last_crossing) << std::endl;
+					log << "]x" << int(last_crossing) << std::endl;
 
 					//record float info:
 					for (uint32_t &u : last_used) {
@@ -635,16 +806,64 @@ std::vector< uint8_t > optimal_dither(DitherParams const &params) {
 		}
 
 		auto after = std::chrono::high_resolution_clock::now();
-		std::cout << " (" <<  std::chrono::duration< double >(before_readback - before).count() * 1000 << "ms";
-		std::cout << " + " <<  std::chrono::duration< double >(after - before_readback).count() * 1000 << "ms";
-		std::cout << " = " <<  std::chrono::duration< double >(after - before).count() * 1000 << "ms)" << std::endl;
+		row_forward_ms[row] = std::chrono::duration< double >(before_readback - before).count() * 1000;
+		out << " (" <<  std::chrono::duration< double >(before_readback - before).count() * 1000 << "ms";
+		out << " + " <<  std::chrono::duration< double >(after - before_readback).count() * 1000 << "ms";
+		out << " = " <<  std::chrono::duration< double >(after - before).count() * 1000 << "ms)" << std::endl;
+	};
+
+	#ifdef USE_THREADS
+	if (row_lanes > 1) {
+		//each job takes a free lane's storage, and prints its row's progress all at once when done:
+		std::mutex lanes_mutex;
+		std::vector< uint32_t > free_lanes;
+		for (uint32_t lane = 0; lane < row_lanes; ++lane) {
+			free_lanes.emplace_back(row_lanes - 1 - lane);
+		}
+		for (uint32_t row = 0; row < image_height; ++row) {
+			job_queue.run([&,row](){
+				uint32_t lane;
+				{
+					std::lock_guard< std::mutex > lock(lanes_mutex);
+					assert(!free_lanes.empty());
+					lane = free_lanes.back();
+					free_lanes.pop_back();
+				}
+				std::ostringstream out;
+				dither_row(row, row_storage[lane], out);
+				{
+					std::lock_guard< std::mutex > lock(lanes_mutex);
+					free_lanes.emplace_back(lane);
+					log << out.str(); log.flush();
+				}
+			});
+		}
+		job_queue.wait();
+	} else
+	#endif //USE_THREADS
+	for (uint32_t row = 0; row < image_height; ++row) {
+		dither_row(row, row_storage[0], log);
+	}
+
+	//(summed in row order, so the totals don't depend on how rows were scheduled)
+	Cost total_cost{0};
+	uint32_t random_choices = 0;
+	double forward_ms = 0.0;
+	for (uint32_t row = 0; row < image_height; ++row) {
+		total_cost += row_costs[row];
+		random_choices += row_random_choices[row];
+		forward_ms += row_forward_ms[row];
 	}
 
 	auto after_dither = std::chrono::high_resolution_clock::now();
 
-	std::cout << "Overall, made " << random_choices << " arbitrary choices among equal-cost alternatives." << std::endl;
+	log << "Overall, made " << random_choices << " arbitrary choices among equal-cost alternatives." << std::endl;
+
+	if (image_width * image_height != 0) {
+		log << "Computing costs took " << forward_ms * 1000.0 / (image_width * image_height) << "us per column." << std::endl;
+	}
 
-	std::cout << "Dither completed in " <<  std::chrono::duration< double >(after_dither - before_dither).count() * 1000 << "ms." << std::endl;
+	log << "Dither completed in " <<  std::chrono::duration< double >(after_dither - before_dither).count() * 1000 << "ms." << std::endl;
 
 	return dithered;
 }
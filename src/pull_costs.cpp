@@ -0,0 +1,222 @@
+#include "pull_costs.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+//NOTE: every from of a state uses the same yarn (the one the state just used), and rounding never reverses an ordering,
+// so the min over froms of (prev_min_costs[from] + yarn cost) is exactly (min over froms of prev_min_costs[from]) + yarn cost.
+// That's what lets the vector versions do a plain gather-min and still match the scalar version bit-for-bit.
+//
+//States only have a handful of froms each (about three with five yarns), so the vector versions give each lane its own 'to' state
+// and step all lanes through their froms together, rather than splitting one state's froms across lanes.
+
+namespace {
+
+//(Backs says whether to write next_backs, so the loop without them doesn't pay for checking)
+template< bool Backs >
+void pull_costs_scalar(Tables const &tables, uint32_t x, Cost const *prev_min_costs, Cost const *yarn_costs, Cost *next_min_costs, uint32_t *next_backs, uint32_t to_begin, uint32_t to_end) {
+	for (uint32_t to = to_begin; to < to_end; ++to) {
+		if (!tables.is_reachable(x+1, to)) continue; //(not valid at this column, so leave at inf)
+		uint32_t const *froms_begin = tables.froms.data() + tables.first_from[to];
+		uint32_t const *froms_end = tables.froms.data() + tables.froms_end(x, to);
+		assert(froms_end <= tables.froms.data() + tables.froms.size());
+
+		Cost best_prev = std::numeric_limits< Cost >::infinity();
+		uint32_t best_offset = 0;
+		uint32_t ties = 0;
+
+		Cost &next_min_cost = next_min_costs[to];
+		for (uint32_t const *yarn_from = froms_begin; yarn_from != froms_end; ++yarn_from) {
+			uint8_t y = *yarn_from >> YARN_SHIFT;
+			uint32_t from = *yarn_from & STATE_MASK;
+			Cost test_cost = prev_min_costs[from] + yarn_costs[y];
+			if (test_cost < next_min_cost) {
+				next_min_cost = test_cost;
+			}
+			if constexpr (Backs) {
+				if (prev_min_costs[from] < best_prev) {
+					best_prev = prev_min_costs[from];
+					best_offset = yarn_from - froms_begin;
+					ties = 1;
+				} else if (prev_min_costs[from] == best_prev) {
+					ties += 1;
+				}
+			}
+		}
+		if constexpr (Backs) next_backs[to] = make_back(best_offset, ties);
+	}
+}
+
+template< bool Backs >
+void pull_costs_packed(Tables const &tables, uint32_t x, Cost const *prev_min_costs, Cost const *yarn_costs, Cost *next_min_costs, uint32_t *next_backs, uint32_t to_begin, uint32_t to_end) {
+	assert(tables.packed());
+	for (uint32_t to = to_begin; to < to_end; ++to) {
+		if (!tables.is_reachable(x+1, to)) continue; //(not valid at this column, so leave at inf)
+
+		uint8_t const *packed = tables.packed_froms.data() + tables.first_packed[to];
+		uint32_t count = tables.froms_end(x, to) - tables.first_from[to];
+		Cost best_prev = std::numeric_limits< Cost >::infinity();
+		uint32_t best_offset = 0;
+		uint32_t ties = 0;
+		uint32_t from = 0;
+		for (uint32_t i = 0; i < count; ++i) {
+			from += read_varint(&packed);
+			if constexpr (Backs) {
+				if (prev_min_costs[from] < best_prev) {
+					best_offset = i;
+					ties = 1;
+				} else if (prev_min_costs[from] == best_prev) {
+					ties += 1;
+				}
+			}
+			best_prev = std::min(best_prev, prev_min_costs[from]);
+		}
+		next_min_costs[to] = std::min(next_min_costs[to], best_prev + yarn_costs[tables.to_yarn[to]]);
+		if constexpr (Backs) next_backs[to] = make_back(best_offset, ties);
+	}
+}
+
+#if defined(__x86_64__)
+static_assert(std::is_same< Cost, float >::value, "Vector kernels gather 32-bit float costs.");
+static_assert(STATE_MASK == 0x07ffffff, "Vector kernels mask off yarns the same way.");
+
+template< bool Backs >
+__attribute__((target("avx2")))
+void pull_costs_avx2(Tables const &tables, uint32_t x, Cost const *prev_min_costs, Cost const *yarn_costs, Cost *next_min_costs, uint32_t *next_backs, uint32_t to_begin, uint32_t to_end) {
+	__m256i const state_mask = _mm256_set1_epi32(STATE_MASK);
+	__m256i const lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 const inf = _mm256_set1_ps(std::numeric_limits< float >::infinity());
+	uint32_t const *froms = tables.froms.data();
+	bool const steady = tables.steady(x);
+	uint32_t to = to_begin;
+	for (; to + 8 <= to_end; to += 8) {
+		//froms of lane l's state are [begin[l], end[l]):
+		__m256i begin = _mm256_loadu_si256(reinterpret_cast< __m256i const * >(tables.first_from.data() + to));
+		__m256i end = _mm256_loadu_si256(reinterpret_cast< __m256i const * >((steady ? tables.steady_froms_end.data() : tables.first_from.data() + 1) + to));
+		if (!tables.steady(x+1)) {
+			uint32_t bits = 0;
+			for (uint32_t l = 0; l < 8; ++l) bits |= uint32_t(tables.is_reachable(x+1, to + l)) << l;
+			__m256i reach = _mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), _mm256_sllv_epi32(_mm256_set1_epi32(1), lanes)), _mm256_setzero_si256());
+			end = _mm256_blendv_epi8(begin, end, reach); //(unreachable states get no froms, so stay at inf)
+		}
+		__m256i count = _mm256_sub_epi32(end, begin);
+		__m256 best = inf;
+		__m256i best_offset = _mm256_setzero_si256();
+		__m256i ties = _mm256_setzero_si256();
+		__m256i yarn_word = _mm256_setzero_si256();
+		for (int32_t k = 0; ; ++k) {
+			__m256i active = _mm256_cmpgt_epi32(count, _mm256_set1_epi32(k));
+			if (_mm256_testz_si256(active, active)) break;
+			__m256i word = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast< int const * >(froms), _mm256_add_epi32(begin, _mm256_set1_epi32(k)), active, 4);
+			if (k == 0) yarn_word = word; //(all froms of a state have the same yarn)
+			__m256i from = _mm256_and_si256(word, state_mask);
+			__m256 prev = _mm256_mask_i32gather_ps(inf, prev_min_costs, from, _mm256_castsi256_ps(active), 4);
+			if constexpr (Backs) {
+				__m256i lower = _mm256_castps_si256(_mm256_cmp_ps(prev, best, _CMP_LT_OQ));
+				__m256i tied = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(prev, best, _CMP_EQ_OQ)), active);
+				best_offset = _mm256_blendv_epi8(best_offset, _mm256_set1_epi32(k), lower);
+				ties = _mm256_blendv_epi8(_mm256_sub_epi32(ties, tied), _mm256_set1_epi32(1), lower); //(tied lanes are -1, so subtracting counts them)
+			}
+			best = _mm256_min_ps(best, prev);
+		}
+		__m256 yarn_cost = _mm256_i32gather_ps(yarn_costs, _mm256_srli_epi32(yarn_word, YARN_SHIFT), 4);
+		__m256 test = _mm256_add_ps(best, yarn_cost);
+		//min(a,b) is (a < b ? a : b), same as the scalar version's update:
+		__m256 next = _mm256_loadu_ps(next_min_costs + to);
+		_mm256_storeu_ps(next_min_costs + to, _mm256_min_ps(test, next));
+		if constexpr (Backs) {
+			__m256i back = _mm256_or_si256(_mm256_slli_epi32(_mm256_min_epu32(ties, _mm256_set1_epi32(BACK_TIES_MAX)), BACK_TIES_SHIFT), best_offset);
+			_mm256_storeu_si256(reinterpret_cast< __m256i * >(next_backs + to), back);
+		}
+	}
+	//leftover states:
+	pull_costs_scalar< Backs >(tables, x, prev_min_costs, yarn_costs, next_min_costs, next_backs, to, to_end);
+}
+
+//(gcc 12's avx512 intrinsic headers trip -Wmaybe-uninitialized on their own placeholder values)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+template< bool Backs >
+__attribute__((target("avx512f")))
+void pull_costs_avx512(Tables const &tables, uint32_t x, Cost const *prev_min_costs, Cost const *yarn_costs, Cost *next_min_costs, uint32_t *next_backs, uint32_t to_begin, uint32_t to_end) {
+	__m512i const state_mask = _mm512_set1_epi32(STATE_MASK);
+	__m512 const inf = _mm512_set1_ps(std::numeric_limits< float >::infinity());
+	uint32_t const *froms = tables.froms.data();
+	bool const steady = tables.steady(x);
+	uint32_t to = to_begin;
+	for (; to + 16 <= to_end; to += 16) {
+		//froms of lane l's state are [begin[l], end[l]):
+		__m512i begin = _mm512_loadu_si512(tables.first_from.data() + to);
+		__m512i end = _mm512_loadu_si512((steady ? tables.steady_froms_end.data() : tables.first_from.data() + 1) + to);
+		__mmask16 reach = 0xffff;
+		if (!tables.steady(x+1)) {
+			reach = 0;
+			for (uint32_t l = 0; l < 16; ++l) reach |= uint32_t(tables.is_reachable(x+1, to + l)) << l;
+		}
+		__m512i count = _mm512_maskz_sub_epi32(reach, end, begin); //(unreachable states get no froms, so stay at inf)
+		__m512 best = inf;
+		__m512i best_offset = _mm512_setzero_si512();
+		__m512i ties = _mm512_setzero_si512();
+		__m512i yarn_word = _mm512_setzero_si512();
+		for (int32_t k = 0; ; ++k) {
+			__mmask16 active = _mm512_cmpgt_epi32_mask(count, _mm512_set1_epi32(k));
+			if (!active) break;
+			__m512i word = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), active, _mm512_add_epi32(begin, _mm512_set1_epi32(k)), froms, 4);
+			if (k == 0) yarn_word = word; //(all froms of a state have the same yarn)
+			__m512i from = _mm512_and_si512(word, state_mask);
+			__m512 prev = _mm512_mask_i32gather_ps(inf, active, from, prev_min_costs, 4);
+			if constexpr (Backs) {
+				__mmask16 lower = _mm512_cmp_ps_mask(prev, best, _CMP_LT_OQ);
+				__mmask16 tied = _mm512_mask_cmp_ps_mask(active, prev, best, _CMP_EQ_OQ);
+				best_offset = _mm512_mask_mov_epi32(best_offset, lower, _mm512_set1_epi32(k));
+				ties = _mm512_mask_add_epi32(ties, tied, ties, _mm512_set1_epi32(1));
+				ties = _mm512_mask_mov_epi32(ties, lower, _mm512_set1_epi32(1));
+			}
+			best = _mm512_min_ps(best, prev);
+		}
+		__m512 yarn_cost = _mm512_i32gather_ps(_mm512_srli_epi32(yarn_word, YARN_SHIFT), yarn_costs, 4);
+		__m512 test = _mm512_add_ps(best, yarn_cost);
+		//min(a,b) is (a < b ? a : b), same as the scalar version's update:
+		__m512 next = _mm512_loadu_ps(next_min_costs + to);
+		_mm512_storeu_ps(next_min_costs + to, _mm512_min_ps(test, next));
+		if constexpr (Backs) {
+			__m512i back = _mm512_or_si512(_mm512_slli_epi32(_mm512_min_epu32(ties, _mm512_set1_epi32(BACK_TIES_MAX)), BACK_TIES_SHIFT), best_offset);
+			_mm512_storeu_si512(next_backs + to, back);
+		}
+	}
+	//leftover states:
+	pull_costs_scalar< Backs >(tables, x, prev_min_costs, yarn_costs, next_min_costs, next_backs, to, to_end);
+}
+#pragma GCC diagnostic pop
+#endif //__x86_64__
+
+}
+
+PullCostsFn get_pull_costs(Tables const &tables, std::string const &version, bool backs, std::string *name) {
+	auto ret = [&](PullCostsFn without_backs, PullCostsFn with_backs, char const *fn_name) {
+		if (name) *name = fn_name;
+		return backs ? with_backs : without_backs;
+	};
+	//the packed layout is all about decoding, so it only has the one version:
+	if (tables.packed()) {
+		if (version == "auto" || version == "packed") return ret(pull_costs_packed< false >, pull_costs_packed< true >, "packed");
+		else return nullptr;
+	}
+
+	if (version == "scalar") return ret(pull_costs_scalar< false >, pull_costs_scalar< true >, "scalar");
+
+	#if defined(__x86_64__)
+	__builtin_cpu_init();
+	//NOTE: 'auto' skips avx512 because its gathers measured slower than avx2's (on a Xeon that supports both)
+	if ((version == "auto" || version == "avx2") && __builtin_cpu_supports("avx2")) return ret(pull_costs_avx2< false >, pull_costs_avx2< true >, "avx2");
+	if (version == "avx512" && __builtin_cpu_supports("avx512f")) return ret(pull_costs_avx512< false >, pull_costs_avx512< true >, "avx512");
+	#endif
+
+	if (version == "auto") return ret(pull_costs_scalar< false >, pull_costs_scalar< true >, "scalar");
+	return nullptr;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Tables.hpp"
+#include "Cost.hpp"
+
+#include <string>
+#include <algorithm>
+
+//the optimal dither's inner loop -- pull costs forward over column x of the row, for the states in [to_begin, to_end):
+// next_min_costs[to] = min(next_min_costs[to], min over froms of (prev_min_costs[from] + yarn_costs[yarn]))
+// (states that can't appear before column x+1 are left alone)
+// if next_backs isn't null, also sets next_backs[to] to a backpointer (see below) to the cheapest froms
+typedef void (*PullCostsFn)(Tables const &tables, uint32_t x, Cost const *prev_min_costs, Cost const *yarn_costs, Cost *next_min_costs, uint32_t *next_backs, uint32_t to_begin, uint32_t to_end);
+
+//backpointers hold the offset (from first_from[to]) of the first from with the lowest prev_min_costs in the low bits,
+// and the number of froms tied for lowest (saturating at BACK_TIES_MAX) in the high bits:
+constexpr uint32_t BACK_OFFSET_MASK = 0x00ffffff;
+constexpr uint32_t BACK_TIES_SHIFT = 24;
+constexpr uint32_t BACK_TIES_MAX = 0xff;
+inline uint32_t make_back(uint32_t offset, uint32_t ties) {
+	assert((offset & BACK_OFFSET_MASK) == offset);
+	return (std::min(ties, BACK_TIES_MAX) << BACK_TIES_SHIFT) | offset;
+}
+
+//get a version of pull_costs for these tables: 'scalar', 'avx2', 'avx512', 'packed' (for packed tables), or 'auto' for the fastest this CPU supports
+// (all versions give bit-identical results; returns nullptr if the version isn't supported)
+// if 'backs' is false, the version returned ignores next_backs
+PullCostsFn get_pull_costs(Tables const &tables, std::string const &version, bool backs, std::string *name = nullptr);
@@ -0,0 +1,339 @@
+#include "select_yarns.hpp"
+#include "JobQueue.hpp"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <cassert>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <random>
+
+ColorHistogram color_histogram(std::vector< uint32_t > const &srgb, uint32_t bits) {
+	assert(1 <= bits && bits <= 8);
+	//keep the top 'bits' bits of each channel:
+	uint32_t const channel_mask = (0xff << (8 - bits)) & 0xff;
+	uint32_t const mask = channel_mask | (channel_mask << 8) | (channel_mask << 16);
+
+	ColorHistogram histogram;
+	std::unordered_map< uint32_t, uint32_t > bin_index;
+	std::vector< uint64_t > counts; //(counted as integers, since a float stops counting at 2^24 pixels)
+	std::vector< std::array< double, 3 > > sums; //(for averaging quantized bins)
+	for (uint32_t px : srgb) {
+		auto ret = bin_index.emplace(px & mask, counts.size());
+		if (ret.second) {
+			histogram.colors.emplace_back(Color::Linear::from_srgb(px));
+			counts.emplace_back(0);
+			sums.push_back({0.0, 0.0, 0.0});
+		}
+		uint32_t b = ret.first->second;
+		counts[b] += 1;
+		if (bits < 8) {
+			Color::Linear c = Color::Linear::from_srgb(px);
+			sums[b][0] += c.r;
+			sums[b][1] += c.g;
+			sums[b][2] += c.b;
+		}
+	}
+	if (bits < 8) {
+		for (uint32_t b = 0; b < histogram.colors.size(); ++b) {
+			histogram.colors[b] = Color::Linear{
+				.r = float(sums[b][0] / double(counts[b])),
+				.g = float(sums[b][1] / double(counts[b])),
+				.b = float(sums[b][2] / double(counts[b])),
+			};
+		}
+	}
+	histogram.weights.reserve(counts.size());
+	for (uint64_t count : counts) {
+		histogram.weights.emplace_back(float(count));
+	}
+	return histogram;
+}
+
+YarnSelection select_yarns_exhaustive(std::vector< std::vector< Cost > > const &yarn_px_costs, uint32_t count, uint32_t max_threads, std::vector< float > const *weights, uint32_t keep) {
+	uint32_t const yarns = yarn_px_costs.size();
+	assert(1 <= count && count <= yarns);
+	assert(keep >= 1);
+	size_t const pixels = yarn_px_costs[0].size();
+	for (auto const &costs : yarn_px_costs) {
+		assert(costs.size() == pixels);
+	}
+	assert(!weights || weights->size() == pixels);
+	float const *weight = (weights ? weights->data() : nullptr);
+
+	JobQueue job_queue(max_threads);
+
+	//subsets are enumerated as ascending lists of yarn indices; each job does all the subsets that start with one 'prefix':
+	// (prefixes are made just long enough to give each worker several jobs)
+	std::vector< std::vector< uint32_t > > prefixes{ {} };
+	while (prefixes.size() < 8 * job_queue.workers.size() && prefixes[0].size() + 1 < count) {
+		std::vector< std::vector< uint32_t > > longer;
+		for (auto const &prefix : prefixes) {
+			uint32_t first = (prefix.empty() ? 0 : prefix.back() + 1);
+			//(leave room for the rest of the subset)
+			for (uint32_t y = first; y + (count - prefix.size()) <= yarns; ++y) {
+				longer.emplace_back(prefix);
+				longer.back().emplace_back(y);
+			}
+		}
+		prefixes = std::move(longer);
+	}
+
+	std::vector< YarnSubset > best; //cheapest subsets so far, cheapest first
+	std::mutex best_mutex;
+	std::atomic< Cost > bound(std::numeric_limits< Cost >::infinity()); //(cost of best['keep'-1] that can be read without locking)
+	std::atomic< uint64_t > subsets(0);
+	std::atomic< uint64_t > cut_short(0);
+
+	for (auto const &prefix : prefixes) {
+		job_queue.run([&,prefix](){
+			std::vector< uint32_t > chosen = prefix;
+			chosen.resize(count);
+
+			//mins[d][i] is the min cost of chosen[0..d] at pixel i
+			// (mins are taken in the same order -- ascending yarn index -- as the original serial search)
+			std::vector< std::vector< Cost > > mins(count - 1, std::vector< Cost >(pixels));
+			auto fill_mins = [&](uint32_t d) {
+				Cost const *costs = yarn_px_costs[chosen[d]].data();
+				if (d == 0) {
+					std::copy(costs, costs + pixels, mins[0].data());
+				} else {
+					Cost const *prev = mins[d-1].data();
+					Cost *next = mins[d].data();
+					for (size_t i = 0; i < pixels; ++i) {
+						next[i] = std::min(prev[i], costs[i]);
+					}
+				}
+			};
+			for (uint32_t d = 0; d < prefix.size(); ++d) {
+				fill_mins(d);
+			}
+
+			//score the subset in 'chosen':
+			auto score = [&]() {
+				subsets += 1;
+				Cost const *prev = (count > 1 ? mins[count-2].data() : nullptr);
+				Cost const *costs = yarn_px_costs[chosen[count-1]].data();
+				Cost total = 0;
+				constexpr size_t Block = 4096; //pixels between checks against the bound
+				for (size_t begin = 0; begin < pixels; begin += Block) {
+					size_t end = std::min(pixels, begin + Block);
+					for (size_t i = begin; i < end; ++i) {
+						Cost px_min = (prev ? std::min(prev[i], costs[i]) : costs[i]);
+						total += (weight ? weight[i] * px_min : px_min);
+					}
+					//(costs and weights are non-negative, so the total can only go up from here)
+					if (total > bound.load(std::memory_order_relaxed)) {
+						cut_short += 1;
+						return;
+					}
+				}
+
+				YarnSubset subset;
+				subset.selected.assign(yarns, 0);
+				for (uint32_t y : chosen) subset.selected[y] = 1;
+				subset.cost = total;
+
+				std::lock_guard< std::mutex > lock(best_mutex);
+				if (best.size() < keep || subset < best.back()) {
+					best.insert(std::upper_bound(best.begin(), best.end(), subset), subset);
+					if (best.size() > keep) best.pop_back();
+					if (best.size() == keep) bound.store(best.back().cost, std::memory_order_relaxed);
+				}
+			};
+
+			//choose yarns for chosen[d..count) from [first, yarns):
+			auto choose = [&](auto &&choose, uint32_t d, uint32_t first) -> void {
+				for (uint32_t y = first; y + (count - d) <= yarns; ++y) {
+					chosen[d] = y;
+					if (d + 1 == count) {
+						score();
+					} else {
+						fill_mins(d);
+						choose(choose, d + 1, y + 1);
+					}
+				}
+			};
+			if (prefix.size() == count) score();
+			else choose(choose, prefix.size(), (prefix.empty() ? 0 : prefix.back() + 1));
+		});
+	}
+	job_queue.wait();
+
+	assert(!best.empty());
+	YarnSelection selection;
+	selection.selected = best[0].selected;
+	selection.cost = best[0].cost;
+	selection.subsets = subsets;
+	selection.cut_short = cut_short;
+	selection.candidates = std::move(best);
+	return selection;
+}
+
+uint64_t count_subsets(uint32_t yarns, uint32_t count) {
+	if (count > yarns) return 0;
+	count = std::min(count, yarns - count);
+	uint64_t subsets = 1;
+	for (uint32_t i = 1; i <= count; ++i) {
+		//(subsets is always C(yarns - count + i - 1, i - 1) here, so this division is exact)
+		if (subsets > std::numeric_limits< uint64_t >::max() / (yarns - count + i)) return std::numeric_limits< uint64_t >::max();
+		subsets = subsets * (yarns - count + i) / i;
+	}
+	return subsets;
+}
+
+YarnSelection select_yarns_swap(std::vector< std::vector< Cost > > const &yarn_px_costs, uint32_t count, uint32_t max_threads, std::vector< float > const *weights, uint32_t restarts, uint32_t keep) {
+	uint32_t const yarns = yarn_px_costs.size();
+	assert(1 <= count && count <= yarns);
+	assert(restarts >= 1);
+	size_t const pixels = yarn_px_costs[0].size();
+	for (auto const &costs : yarn_px_costs) {
+		assert(costs.size() == pixels);
+	}
+	assert(!weights || weights->size() == pixels);
+	float const *weight = (weights ? weights->data() : nullptr);
+
+	//total cost of a subset, summed exactly the way select_yarns_exhaustive sums it (so costs from the two can be compared):
+	auto subset_cost = [&](std::vector< uint8_t > const &selected) {
+		Cost total = 0;
+		for (size_t i = 0; i < pixels; ++i) {
+			Cost px_min = std::numeric_limits< Cost >::infinity();
+			for (uint32_t y = 0; y < yarns; ++y) {
+				if (selected[y]) px_min = std::min(px_min, yarn_px_costs[y][i]);
+			}
+			total += (weight ? weight[i] * px_min : px_min);
+		}
+		return total;
+	};
+
+	std::vector< YarnSubset > ends(restarts); //where each restart ended up
+	std::atomic< uint64_t > swaps(0);
+
+	JobQueue job_queue(max_threads);
+
+	for (uint32_t restart = 0; restart < restarts; ++restart) {
+		job_queue.run([&,restart](){
+			std::vector< uint32_t > chosen; //selected yarns
+			std::vector< uint8_t > selected(yarns, 0);
+
+			if (restart == 0) {
+				//add yarns one at a time, each time picking the one that lowers the cost the most:
+				std::vector< Cost > px_min(pixels, std::numeric_limits< Cost >::infinity());
+				while (chosen.size() < count) {
+					uint32_t add = yarns;
+					double add_total = std::numeric_limits< double >::infinity();
+					for (uint32_t y = 0; y < yarns; ++y) {
+						if (selected[y]) continue;
+						Cost const *costs = yarn_px_costs[y].data();
+						double total = 0.0;
+						for (size_t i = 0; i < pixels; ++i) {
+							Cost m = std::min(px_min[i], costs[i]);
+							total += (weight ? weight[i] * m : m);
+						}
+						if (total < add_total) {
+							add_total = total;
+							add = y;
+						}
+					}
+					assert(add < yarns);
+					chosen.emplace_back(add);
+					selected[add] = 1;
+					for (size_t i = 0; i < pixels; ++i) {
+						px_min[i] = std::min(px_min[i], yarn_px_costs[add][i]);
+					}
+				}
+			} else {
+				std::mt19937 mt(restart);
+				std::vector< uint32_t > order(yarns);
+				for (uint32_t y = 0; y < yarns; ++y) order[y] = y;
+				std::shuffle(order.begin(), order.end(), mt);
+				chosen.assign(order.begin(), order.begin() + count);
+				for (uint32_t y : chosen) selected[y] = 1;
+			}
+
+			//for each pixel, the slot (in chosen) of its cheapest selected yarn, that yarn's cost, and the next-cheapest's cost:
+			std::vector< uint32_t > nearest(pixels);
+			std::vector< Cost > first(pixels), second(pixels);
+			auto update_nearest = [&]() {
+				for (size_t i = 0; i < pixels; ++i) {
+					Cost f = std::numeric_limits< Cost >::infinity();
+					Cost s = std::numeric_limits< Cost >::infinity();
+					uint32_t n = 0;
+					for (uint32_t slot = 0; slot < count; ++slot) {
+						Cost c = yarn_px_costs[chosen[slot]][i];
+						if (c < f) {
+							s = f;
+							f = c;
+							n = slot;
+						} else if (c < s) {
+							s = c;
+						}
+					}
+					nearest[i] = n;
+					first[i] = f;
+					second[i] = s;
+				}
+			};
+			update_nearest();
+
+			std::vector< double > slot_delta(count);
+			while (true) {
+				double current = 0.0;
+				for (size_t i = 0; i < pixels; ++i) {
+					current += (weight ? weight[i] * first[i] : first[i]);
+				}
+
+				//swapping in yarn y for the yarn in 'slot' changes pixel i's cost to:
+				//  min(c_y, first) if slot isn't nearest[i], min(c_y, second) if it is
+				// so the change for every slot is a shared part plus a part from the pixels the slot is nearest to:
+				uint32_t best_slot = count;
+				uint32_t best_in = yarns;
+				double best_delta = -1e-6 * current; //(only take swaps that clearly help, so rounding can't cause cycles)
+				for (uint32_t y = 0; y < yarns; ++y) {
+					if (selected[y]) continue;
+					Cost const *costs = yarn_px_costs[y].data();
+					double shared = 0.0;
+					std::fill(slot_delta.begin(), slot_delta.end(), 0.0);
+					for (size_t i = 0; i < pixels; ++i) {
+						double w = (weight ? weight[i] : 1.0);
+						double gain = std::min(0.0, double(costs[i]) - double(first[i]));
+						shared += w * gain;
+						slot_delta[nearest[i]] += w * (double(std::min(costs[i], second[i])) - double(first[i]) - gain);
+					}
+					for (uint32_t slot = 0; slot < count; ++slot) {
+						double delta = shared + slot_delta[slot];
+						if (delta < best_delta) {
+							best_delta = delta;
+							best_slot = slot;
+							best_in = y;
+						}
+					}
+				}
+				if (best_in == yarns) break;
+
+				selected[chosen[best_slot]] = 0;
+				selected[best_in] = 1;
+				chosen[best_slot] = best_in;
+				update_nearest();
+				swaps += 1;
+			}
+
+			ends[restart].cost = subset_cost(selected);
+			ends[restart].selected = selected;
+		});
+	}
+	job_queue.wait();
+
+	std::sort(ends.begin(), ends.end());
+	ends.erase(std::unique(ends.begin(), ends.end(), [](YarnSubset const &a, YarnSubset const &b){ return a.selected == b.selected; }), ends.end());
+	if (ends.size() > keep) ends.resize(keep);
+
+	YarnSelection selection;
+	selection.selected = ends[0].selected;
+	selection.cost = ends[0].cost;
+	selection.swaps = swaps;
+	selection.candidates = std::move(ends);
+	return selection;
+}
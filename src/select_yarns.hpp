@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Color.hpp"
+#include "Cost.hpp"
+
+#include <vector>
+#include <cstdint>
+
+//yarn subset selection for --select-yarns
+// (estimates only -- these ignore fabrication limits and error diffusion)
+
+struct YarnSubset {
+	std::vector< uint8_t > selected; //selected[y] is 1 if yarn y is in the subset
+	Cost cost = 0; //sum over pixels of the cheapest selected yarn's cost
+	//order subsets cheapest first (ties go to the one std::next_permutation on 'selected' would reach first):
+	bool operator<(YarnSubset const &other) const {
+		return cost < other.cost || (cost == other.cost && selected < other.selected);
+	}
+};
+
+struct YarnSelection {
+	std::vector< uint8_t > selected; //selected[y] is 1 if yarn y is in the subset
+	Cost cost = 0; //sum over pixels of the cheapest selected yarn's cost
+	uint64_t subsets = 0; //subsets scored
+	uint64_t cut_short = 0; //subsets whose scoring stopped early because they couldn't win
+	uint64_t swaps = 0; //swaps made, over all restarts (select_yarns_swap only)
+	std::vector< YarnSubset > candidates; //the cheapest 'keep' subsets found, cheapest first (so candidates[0] is selected/cost)
+};
+
+//weighted histogram of the colors in an image, for scoring yarn subsets over distinct colors instead of over every pixel:
+struct ColorHistogram {
+	std::vector< Color::Linear > colors; //color of each bin
+	std::vector< float > weights; //number of pixels in each bin
+};
+
+//build a histogram of srgb image colors with 'bits' bits per channel (1 to 8):
+// with 8 bits, every distinct color gets its own bin; with fewer, nearby colors share a bin, whose color is their mean linear color
+ColorHistogram color_histogram(std::vector< uint32_t > const &srgb, uint32_t bits);
+
+//try every subset of 'count' yarns and return the cheapest (and the next 'keep'-1 cheapest), where yarn_px_costs[y][i] is the cost of yarn y at pixel i:
+// (if 'weights' isn't null, pixel i counts weights[i] times -- e.g., for the bins of a ColorHistogram)
+// subsets are split over up to max_threads threads (0 == all cores); partial per-pixel minima are shared by subsets with
+// the same first yarns, and a subset stops being scored once its partial sum is already worse than the 'keep'-th best found so far.
+// (ties go to the subset std::next_permutation on 'selected' would reach first, starting from the last 'count' yarns,
+//  and costs are summed in pixel order, so this always picks the same subset a simple serial search would)
+YarnSelection select_yarns_exhaustive(std::vector< std::vector< Cost > > const &yarn_px_costs, uint32_t count, uint32_t max_threads, std::vector< float > const *weights = nullptr, uint32_t keep = 1);
+
+//local search for a cheap subset of 'count' yarns (for palettes too big to search exhaustively):
+// each restart starts from a subset -- restart 0 adds yarns greedily, the others pick at random -- and then repeatedly
+// makes the best single swap of a selected yarn for an unselected one (as in k-medoids' PAM) until no swap helps.
+// restarts run in parallel on up to max_threads threads (0 == all cores); the result is the cheapest subset found, with
+// the same tie-breaking as select_yarns_exhaustive, so it does not depend on thread timing.
+// (candidates holds the cheapest 'keep' distinct subsets that restarts ended on)
+YarnSelection select_yarns_swap(std::vector< std::vector< Cost > > const &yarn_px_costs, uint32_t count, uint32_t max_threads, std::vector< float > const *weights = nullptr, uint32_t restarts = 8, uint32_t keep = 1);
+
+//number of subsets select_yarns_exhaustive would score (saturating at UINT64_MAX):
+uint64_t count_subsets(uint32_t yarns, uint32_t count);
@@ -0,0 +1,836 @@
+#include "Tables.hpp"
+#include "JobQueue.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <unordered_map>
+#include <numeric>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+Tables::Mapping::~Mapping() {
+	munmap(data, size);
+}
+
+Tables build_tables(DitherParams const &params, uint32_t columns, JobQueue *job_queue) {
+	std::ostream &log = *params.log;
+	uint32_t const yarns = params.yarns_linear.size();
+
+	bool print_state_table = false; //show the states and their transitions
+
+	auto before = std::chrono::high_resolution_clock::now();
+
+	//NOTE: with per-column tables, a 6-yarn table build took about 49sec; 5-yarn took about 2.7sec
+
+	//Transitions only depend on the column through the "never used yet" / "never crossed yet" checks,
+	// and those checks only look at the state being moved into. So each state is expanded just once
+	// (at the first column it can appear before) and each transition is kept along with the last
+	// column at which its 'to' state is allowed.
+
+	//every state found so far, in order of discovery:
+	std::vector< State > states;
+	std::unordered_map< State, uint32_t > index;
+
+	//last column at which moving into each state is valid (-1U if always valid):
+	std::vector< uint32_t > last_column;
+	auto get_last_column = [&params](State const &state) -> uint32_t {
+		uint32_t last = -1U;
+		if (params.use_within != 0) {
+			//a yarn that hasn't been used yet is only okay while x + 2 <= use_within (see State::advanced):
+			for (auto const &last_used : state.last_used) {
+				if (last_used == 0) {
+					assert(params.use_within >= 2);
+					last = std::min(last, params.use_within - 2);
+					break;
+				}
+			}
+		}
+		if (params.cross_within != 0 && state.last_cross == 0) {
+			//no crossing yet is only okay while x + 2 <= cross_within (see State::use):
+			assert(params.cross_within >= 2);
+			last = std::min(last, params.cross_within - 2);
+		}
+		return last;
+	};
+
+	//"push"-style transitions of every expanded state:
+	// tos[first_to[s]] .. tos[first_to[s+1]-1] are (yarn << YARN_SHIFT) | (next state index)
+	std::vector< uint32_t > first_to;
+	std::vector< uint32_t > tos;
+
+	{ //initial state:
+		State init(yarns);
+		//mark all yarns as unused:
+		for (auto &last_used : init.last_used) {
+			last_used = 0;
+		}
+		//get the full cross_within limit:
+		init.last_cross = 0;
+
+		//(this is actually what the standard State() constructor already does)
+
+		states.emplace_back(init);
+		index.emplace(init, 0);
+		last_column.emplace_back(-1U); //(never moved into anyway)
+		first_to.emplace_back(0);
+	}
+
+	//expand states [first_to.size()-1, states.size()) -- the ones first found at the previous column -- at column x:
+	// (Yarns_ is an integral constant giving the yarn count, or zero for generic code; see with_yarn_count)
+	auto expand = [&](uint32_t x, auto Yarns_) {
+		constexpr uint32_t Yarns = decltype(Yarns_)::value;
+		uint32_t const end = states.size();
+		for (uint32_t s = first_to.size() - 1; s < end; ++s) {
+			State const state = states[s]; //(copy, since states might reallocate)
+			if (print_state_table) log << "" << s << ":" << state << " ->";
+			state.next_states< Yarns >(params, x, [&](uint32_t y, State const &next_state){
+				uint32_t next_last_column = get_last_column(next_state);
+				if (x > next_last_column) return; //(not valid at this column, so never valid again)
+
+				auto ret = index.emplace(next_state, states.size());
+				if (ret.second) {
+					states.emplace_back(next_state);
+					last_column.emplace_back(next_last_column);
+				}
+				uint32_t to = ret.first->second;
+				assert(states.at(to) == next_state);
+
+				assert((to & STATE_MASK) == to); //state indices must be small enough to pack
+				tos.emplace_back((y << YARN_SHIFT) | to);
+
+				if (print_state_table) log << " " << to << ":" << next_state;
+			});
+			first_to.emplace_back(tos.size());
+			if (print_state_table) log << std::endl;
+		}
+	};
+
+	//same result as expand, but splits the work over the job queue's workers:
+	// (1) each chunk of states finds its successors; ones not already indexed are numbered in order of first appearance in the chunk;
+	// (2) each shard (new states split by hash) finds the first chunk-local appearance of each of its states;
+	// (3) a serial pass numbers new states in order of first appearance, which is exactly the order expand uses;
+	// (4) transitions get their final indices and are appended in order.
+	auto expand_parallel = [&](uint32_t x, auto Yarns_) {
+		constexpr uint32_t Yarns = decltype(Yarns_)::value;
+		assert(job_queue);
+		uint32_t const begin = first_to.size() - 1;
+		uint32_t const end = states.size();
+		uint32_t const shards = job_queue->workers.size();
+		uint32_t const chunks = std::min< uint32_t >(4 * shards, end - begin);
+		constexpr uint32_t NEW = 0x80000000; //marks chunk-local indices of new states in Chunk::tos
+
+		struct Chunk {
+			std::vector< State > states; //new successor states, in order of first appearance in this chunk
+			std::vector< uint32_t > last_column; //last valid column of each new state
+			std::vector< uint32_t > shard; //shard of each new state
+			std::vector< uint32_t > entry; //index of each new state within its shard
+			std::vector< uint32_t > index; //final index of each new state
+
+			std::vector< uint32_t > counts; //transitions from each expanded state
+			std::vector< uint8_t > yarns; //yarn used by each transition
+			std::vector< uint32_t > tos; //state reached by each transition (index, or NEW | chunk-local index)
+		};
+		std::vector< Chunk > chunk_data(chunks);
+
+		//(1) expand chunks:
+		// ('index' isn't modified until all chunks are done, so looking things up in it is safe)
+		for (uint32_t c = 0; c < chunks; ++c) {
+			job_queue->run([&,c](){
+				Chunk &chunk = chunk_data[c];
+				uint32_t chunk_begin = begin + uint64_t(end - begin) * c / chunks;
+				uint32_t chunk_end = begin + uint64_t(end - begin) * (c+1) / chunks;
+				std::unordered_map< State, uint32_t > local_index;
+				for (uint32_t s = chunk_begin; s < chunk_end; ++s) {
+					uint32_t count = 0;
+					states[s].next_states< Yarns >(params, x, [&](uint32_t y, State const &next_state){
+						uint32_t next_last_column = get_last_column(next_state);
+						if (x > next_last_column) return;
+
+						count += 1;
+						chunk.yarns.emplace_back(y);
+						auto f = index.find(next_state);
+						if (f != index.end()) {
+							chunk.tos.emplace_back(f->second);
+						} else {
+							auto ret = local_index.emplace(next_state, chunk.states.size());
+							if (ret.second) {
+								chunk.states.emplace_back(next_state);
+								chunk.last_column.emplace_back(next_last_column);
+							}
+							chunk.tos.emplace_back(NEW | ret.first->second);
+						}
+					});
+					chunk.counts.emplace_back(count);
+				}
+				std::hash< State > hash;
+				chunk.shard.reserve(chunk.states.size());
+				for (State const &state : chunk.states) {
+					chunk.shard.emplace_back(hash(state) % shards);
+				}
+				chunk.entry.resize(chunk.states.size());
+			});
+		}
+		job_queue->wait();
+
+		//(2) merge chunk-local states by shard:
+		std::vector< std::vector< std::pair< uint32_t, uint32_t > > > shard_firsts(shards); //(chunk, local index) of first appearance of each state in the shard
+		for (uint32_t k = 0; k < shards; ++k) {
+			job_queue->run([&,k](){
+				std::unordered_map< State, uint32_t > shard_index;
+				for (uint32_t c = 0; c < chunks; ++c) {
+					Chunk &chunk = chunk_data[c];
+					for (uint32_t l = 0; l < chunk.states.size(); ++l) {
+						if (chunk.shard[l] != k) continue;
+						auto ret = shard_index.emplace(chunk.states[l], shard_firsts[k].size());
+						if (ret.second) shard_firsts[k].emplace_back(c, l);
+						chunk.entry[l] = ret.first->second;
+					}
+				}
+			});
+		}
+		job_queue->wait();
+
+		//(3) number states in order of first appearance:
+		std::vector< std::vector< uint32_t > > shard_to_index(shards);
+		for (uint32_t k = 0; k < shards; ++k) {
+			shard_to_index[k].resize(shard_firsts[k].size(), -1U);
+		}
+		for (uint32_t c = 0; c < chunks; ++c) {
+			Chunk const &chunk = chunk_data[c];
+			for (uint32_t l = 0; l < chunk.states.size(); ++l) {
+				uint32_t k = chunk.shard[l];
+				uint32_t e = chunk.entry[l];
+				if (shard_firsts[k][e] == std::make_pair(c, l)) {
+					assert(shard_to_index[k][e] == -1U);
+					shard_to_index[k][e] = states.size();
+					index.emplace(chunk.states[l], states.size());
+					states.emplace_back(chunk.states[l]);
+					last_column.emplace_back(chunk.last_column[l]);
+				}
+			}
+		}
+
+		for (uint32_t c = 0; c < chunks; ++c) {
+			job_queue->run([&,c](){
+				Chunk &chunk = chunk_data[c];
+				chunk.index.reserve(chunk.states.size());
+				for (uint32_t l = 0; l < chunk.states.size(); ++l) {
+					chunk.index.emplace_back(shard_to_index[chunk.shard[l]][chunk.entry[l]]);
+					assert(chunk.index.back() < states.size());
+				}
+			});
+		}
+		job_queue->wait();
+
+		//(4) append transitions:
+		for (Chunk const &chunk : chunk_data) {
+			uint32_t i = 0;
+			for (uint32_t count : chunk.counts) {
+				for (uint32_t e = 0; e < count; ++e, ++i) {
+					uint32_t to = chunk.tos[i];
+					if (to & NEW) to = chunk.index[to & ~NEW];
+					assert((to & STATE_MASK) == to); //state indices must be small enough to pack
+					tos.emplace_back((uint32_t(chunk.yarns[i]) << YARN_SHIFT) | to);
+				}
+				first_to.emplace_back(tos.size());
+			}
+			assert(i == chunk.tos.size());
+		}
+		assert(first_to.size() == end + 1);
+	};
+
+	//reachable[x] is a bitmask of the states that can appear before column x:
+	// (sized for the states found by then)
+	std::vector< std::vector< uint64_t > > reachable;
+	reachable.emplace_back(1, 1); //just the initial state
+
+	uint32_t warmup = -1U;
+	for (uint32_t x = 0; x < columns; ++x) {
+		//small expansions (or debug output) aren't worth splitting up:
+		bool parallel = (job_queue != nullptr && job_queue->workers.size() > 1 && states.size() - (first_to.size() - 1) >= 1024 && !print_state_table);
+
+		with_yarn_count(yarns, [&](auto Yarns) {
+			if (parallel) expand_parallel(x, Yarns);
+			else expand(x, Yarns);
+		});
+
+		std::vector< uint64_t > next((states.size() + 63) / 64, 0);
+		std::vector< uint64_t > const &prev = reachable[x];
+		for (uint32_t w = 0; w < prev.size(); ++w) {
+			for (uint64_t bits = prev[w]; bits != 0; bits &= bits - 1) {
+				uint32_t s = 64 * w + std::countr_zero(bits);
+				for (uint32_t i = first_to[s]; i < first_to[s+1]; ++i) {
+					uint32_t to = tos[i] & STATE_MASK;
+					if (x <= last_column[to]) next[to / 64] |= uint64_t(1) << (to % 64);
+				}
+			}
+		}
+
+		uint32_t count = 0;
+		for (uint64_t w : next) count += std::popcount(w);
+		log << "Table size at " << x << " is " << count << std::endl;
+
+		//if the same states can appear before columns x and x+1, and they can all keep appearing, every later column is the same:
+		bool same = true;
+		for (uint32_t w = 0; w < next.size(); ++w) {
+			if (next[w] != (w < prev.size() ? prev[w] : 0)) {
+				same = false;
+				break;
+			}
+		}
+		if (same) {
+			for (uint32_t w = 0; w < next.size() && same; ++w) {
+				for (uint64_t bits = next[w]; bits != 0; bits &= bits - 1) {
+					if (last_column[64 * w + std::countr_zero(bits)] != -1U) {
+						same = false;
+						break;
+					}
+				}
+			}
+		}
+
+		reachable.emplace_back(std::move(next)); //(prev is invalid after this)
+
+		if (same) {
+			log << "  this is the last table." << std::endl;
+			warmup = x;
+			break;
+		}
+	}
+
+	Tables ret;
+
+	std::vector< uint64_t > steady_mask;
+	if (warmup != -1U) {
+		steady_mask = std::move(reachable[warmup]);
+		reachable.resize(warmup);
+	} else {
+		//never converged, so every column gets a mask:
+		warmup = reachable.size();
+		assert(warmup == columns + 1);
+	}
+	steady_mask.resize((states.size() + 63) / 64, 0);
+	auto is_steady = [&](uint32_t s) { return (steady_mask[s / 64] >> (s % 64)) & 1; };
+
+	//renumber so steady states come first, and sort each group (steady / not) by state:
+	// the froms that use yarn y differ only in last_used[y], so with states in sorted order the pull kernel's
+	// reads of prev_min_costs[from] form a few sequential streams (one per yarn) rather than scattering over the whole column.
+	// (reverse Cuthill-McKee ordering, which just keeps each from near its to, was measured to be slower than the order states were found in)
+	std::vector< uint32_t > old_index;
+	old_index.reserve(states.size());
+	for (uint32_t pass = 0; pass < 2; ++pass) {
+		uint32_t const group_begin = old_index.size();
+		for (uint32_t s = 0; s < states.size(); ++s) {
+			if (is_steady(s) == (pass == 0)) old_index.emplace_back(s);
+		}
+		std::sort(old_index.begin() + group_begin, old_index.end(), [&](uint32_t a, uint32_t b) {
+			return states[a] < states[b];
+		});
+		if (pass == 0) ret.steady_states = old_index.size();
+	}
+	assert(old_index.size() == states.size());
+	ret.warmup = warmup;
+
+	std::vector< uint32_t > new_index(states.size(), -1U);
+	for (uint32_t s = 0; s < old_index.size(); ++s) {
+		new_index[old_index[s]] = s;
+	}
+
+	{ //report how well the steady-state pull kernel's reads hit cache, before (steady first, in order found) and after sorting:
+		// (modeled as a 32k direct-mapped cache of 64-byte lines holding prev_min_costs)
+		auto cache_misses = [&](std::vector< uint32_t > const &numbering) -> double {
+			std::vector< std::vector< uint32_t > > pull_froms(ret.steady_states);
+			for (uint32_t s = 0; s + 1 < first_to.size(); ++s) {
+				if (!is_steady(s)) continue;
+				for (uint32_t i = first_to[s]; i < first_to[s+1]; ++i) {
+					uint32_t t = tos[i] & STATE_MASK;
+					if (is_steady(t)) pull_froms[numbering[t]].emplace_back(numbering[s]);
+				}
+			}
+			constexpr uint32_t Lines = 32768 / 64;
+			constexpr uint32_t PerLine = 64 / sizeof(float);
+			std::vector< uint32_t > cache(Lines, -1U);
+			uint64_t reads = 0;
+			uint64_t misses = 0;
+			for (auto &froms : pull_froms) {
+				std::sort(froms.begin(), froms.end());
+				for (uint32_t from : froms) {
+					uint32_t line = from / PerLine;
+					if (cache[line % Lines] != line) {
+						cache[line % Lines] = line;
+						misses += 1;
+					}
+					reads += 1;
+				}
+			}
+			return (reads == 0 ? 0.0 : misses / double(reads));
+		};
+		std::vector< uint32_t > found_index(states.size(), -1U);
+		uint32_t steady_found = 0;
+		for (uint32_t s = 0; s < states.size(); ++s) {
+			if (is_steady(s)) found_index[s] = steady_found++;
+		}
+		log << "Sorted states: modeled cache misses per steady transition went from " << cache_misses(found_index) << " to " << cache_misses(new_index) << "." << std::endl;
+	}
+
+	ret.states.reserve(states.size());
+	for (uint32_t s : old_index) {
+		ret.states.emplace_back(states[s]);
+	}
+
+	//collapse transitions into a nice compact "pull" format:
+	std::vector< uint32_t > first_from(states.size() + 1, 0);
+	for (uint32_t i = 0; i < tos.size(); ++i) {
+		first_from[new_index[tos[i] & STATE_MASK] + 1] += 1;
+	}
+	for (uint32_t to = 0; to < states.size(); ++to) {
+		first_from[to + 1] += first_from[to];
+	}
+	assert(first_from.back() == tos.size());
+
+	std::vector< uint32_t > froms(tos.size());
+	{
+		std::vector< uint32_t > next_from(first_from.begin(), first_from.end() - 1);
+		//(visiting froms in new index order keeps each state's froms ascending)
+		for (uint32_t from = 0; from < states.size(); ++from) {
+			uint32_t s = old_index[from];
+			if (s + 1 >= first_to.size()) continue; //(never expanded, so no transitions)
+			for (uint32_t i = first_to[s]; i < first_to[s+1]; ++i) {
+				uint32_t to = new_index[tos[i] & STATE_MASK];
+				froms[next_from[to]++] = (tos[i] & ~STATE_MASK) | from;
+			}
+		}
+	}
+
+	std::vector< uint32_t > steady_froms_end(ret.steady_states);
+	for (uint32_t to = 0; to < ret.steady_states; ++to) {
+		uint32_t i = first_from[to];
+		while (i < first_from[to+1] && (froms[i] & STATE_MASK) < ret.steady_states) ++i;
+		steady_froms_end[to] = i;
+	}
+
+	//PARANOIA: states are always pulled from in order, right?
+	for (uint32_t to = 0; to < states.size(); ++to) {
+		for (uint32_t i = first_from[to]; i + 1 < first_from[to+1]; ++i) {
+			assert((froms[i] & STATE_MASK) < (froms[i+1] & STATE_MASK));
+		}
+	}
+
+	//reachable masks in the new order:
+	ret.mask_storage.reserve(reachable.size());
+	for (auto const &mask : reachable) {
+		std::vector< uint64_t > &remapped = ret.mask_storage.emplace_back((states.size() + 63) / 64, 0);
+		for (uint32_t w = 0; w < mask.size(); ++w) {
+			for (uint64_t bits = mask[w]; bits != 0; bits &= bits - 1) {
+				uint32_t s = new_index[64 * w + std::countr_zero(bits)];
+				remapped[s / 64] |= uint64_t(1) << (s % 64);
+			}
+		}
+		ret.reachable.emplace_back(remapped);
+	}
+
+	//(moving a vector keeps its data pointer, so the spans stay valid)
+	ret.first_from = ret.storage.emplace_back(std::move(first_from));
+	ret.steady_froms_end = ret.storage.emplace_back(std::move(steady_froms_end));
+	ret.froms = ret.storage.emplace_back(std::move(froms));
+
+	auto after = std::chrono::high_resolution_clock::now();
+	log << "Built transition automaton with " << ret.states.size() << " states (" << ret.steady_states << " after " << ret.warmup << " warm-up columns) and " << ret.froms.size() << " transitions in " << std::chrono::duration< double >(after - before).count() * 1000.0 << "ms." << std::endl;
+
+	return ret;
+}
+
+void pack_froms(Tables *tables_) {
+	assert(tables_);
+	Tables &tables = *tables_;
+
+	tables.to_yarn.clear();
+	tables.to_yarn.reserve(tables.states.size());
+	tables.first_packed.clear();
+	tables.first_packed.reserve(tables.states.size() + 1);
+	tables.packed_froms.clear();
+	tables.packed_froms.reserve(tables.froms.size() * 2);
+
+	for (uint32_t to = 0; to < tables.states.size(); ++to) {
+		uint32_t yarn = tables.states[to].used_yarn();
+		tables.to_yarn.emplace_back(yarn == -1U ? 0xff : yarn); //(only the row's initial state has no yarn, and it has no froms)
+		tables.first_packed.emplace_back(tables.packed_froms.size());
+
+		uint32_t prev = 0;
+		for (uint32_t i = tables.first_from[to]; i < tables.first_from[to+1]; ++i) {
+			assert((tables.froms[i] >> YARN_SHIFT) == yarn);
+			uint32_t from = tables.froms[i] & STATE_MASK;
+			assert(from >= prev);
+			uint32_t delta = from - prev;
+			prev = from;
+			while (delta >= 0x80) {
+				tables.packed_froms.emplace_back(0x80 | (delta & 0x7f));
+				delta >>= 7;
+			}
+			tables.packed_froms.emplace_back(delta);
+		}
+	}
+	tables.first_packed.emplace_back(tables.packed_froms.size());
+
+	std::cout << "Packed " << tables.froms.size() << " froms (" << tables.froms.size() * 4 << " bytes) into " << tables.packed_froms.size() << " bytes." << std::endl;
+}
+
+void push_transitions(Tables const &tables, std::vector< uint32_t > *first_to_, std::vector< uint32_t > *tos_) {
+	assert(first_to_);
+	assert(tos_);
+	std::vector< uint32_t > &first_to = *first_to_;
+	std::vector< uint32_t > &tos = *tos_;
+	uint32_t const state_count = tables.states.size();
+
+	first_to.assign(state_count + 1, 0);
+	tos.resize(tables.froms.size());
+	for (uint32_t from : tables.froms) {
+		first_to[(from & STATE_MASK) + 1] += 1;
+	}
+	for (uint32_t s = 0; s < state_count; ++s) {
+		first_to[s + 1] += first_to[s];
+	}
+	std::vector< uint32_t > next_to(first_to.begin(), first_to.end() - 1);
+	for (uint32_t to = 0; to < state_count; ++to) {
+		for (uint32_t i = tables.first_from[to]; i < tables.first_from[to+1]; ++i) {
+			tos[next_to[tables.froms[i] & STATE_MASK]++] = (tables.froms[i] & ~STATE_MASK) | to;
+		}
+	}
+}
+
+//does state a dominate state b (see Tables::first_dominator)? this is checked for states that appear before the same column,
+// where a yarn that hasn't been used yet acts like one last used just past the row's start (so, longer ago than any that has),
+// and "no crossing yet" acts like a crossing that started just past the row's start (so, longer ago than any that has). Then:
+//  - a yarn last used fewer steps ago is no worse for use_within, and (if the counts have the same parity) reusing it makes a
+//    crossing whenever the other would, one that started more recently; crossings only ever lower last_cross, so they never hurt.
+//  - a count clamped at cross_within + 1 (with use_within disabled) has lost its parity, but any crossing it makes is too old to help.
+//  - a lower last_cross stays lower.
+// the same yarns take a and b to states where this still holds, so a can follow any valid path b can.
+static bool dominates(State const &a, State const &b, DitherParams const &params) {
+	if (a == b) return false;
+	uint32_t const clamped = (params.use_within == 0 && params.cross_within != 0 ? params.cross_within + 1 : 0);
+	for (uint32_t y = 0; y < b.last_used.size(); ++y) {
+		uint8_t p = a.last_used[y];
+		uint8_t q = b.last_used[y];
+		if (p == q) continue;
+		if (p == 0) return false;
+		if (q == 0) continue;
+		if (q == clamped && p < q) continue;
+		if (p < q && (q - p) % 2 == 0) continue;
+		return false;
+	}
+	if (a.last_cross == b.last_cross) return true;
+	return a.last_cross != 0 && (b.last_cross == 0 || a.last_cross < b.last_cross);
+}
+
+void build_dominance(Tables *tables_, DitherParams const &params) {
+	std::ostream &log = *params.log;
+	assert(tables_);
+	Tables &tables = *tables_;
+	uint32_t const yarns = params.yarns_linear.size();
+
+	auto before = std::chrono::high_resolution_clock::now();
+
+	std::unordered_map< State, uint32_t > index;
+	index.reserve(tables.states.size());
+	for (uint32_t s = 0; s < tables.states.size(); ++s) {
+		index.emplace(tables.states[s], s);
+	}
+
+	//the largest count a yarn can have (the most a used yarn can replace an unused one with), and the count that's clamped (if any):
+	uint32_t const max_count = (params.use_within != 0 ? params.use_within : params.cross_within != 0 ? params.cross_within + 1 : 2);
+	uint32_t const clamped = (params.use_within == 0 && params.cross_within != 0 ? params.cross_within + 1 : 0);
+
+	//one step of dominance is one yarn's count two lower (or, for an unused yarn, the largest count of either parity),
+	// or last_cross one lower (or, for no crossing yet, cross_within):
+	tables.first_dominator.clear();
+	tables.first_dominator.reserve(tables.states.size() + 1);
+	tables.dominators.clear();
+	for (uint32_t b = 0; b < tables.states.size(); ++b) {
+		tables.first_dominator.emplace_back(tables.dominators.size());
+		State const &state = tables.states[b];
+		auto add = [&](State const &dominator) {
+			auto f = index.find(dominator);
+			if (f == index.end()) return;
+			assert(dominates(dominator, state, params));
+			tables.dominators.emplace_back(f->second);
+		};
+		for (uint32_t y = 0; y < yarns; ++y) {
+			uint8_t count = state.last_used[y];
+			std::array< uint32_t, 2 > lower{0, 0};
+			if (count == 0) lower = {max_count, max_count - 1};
+			else if (count == clamped) lower = {count - 1u, count - 2u};
+			else if (count >= 3) lower = {count - 2u, 0};
+			for (uint32_t l : lower) {
+				if (l == 0) continue;
+				State dominator = state;
+				dominator.last_used[y] = l;
+				add(dominator);
+			}
+		}
+		if (state.last_cross >= 3) {
+			State dominator = state;
+			dominator.last_cross -= 1;
+			add(dominator);
+		} else if (state.last_cross == 0 && params.cross_within != 0) {
+			State dominator = state;
+			dominator.last_cross = params.cross_within;
+			add(dominator);
+		}
+	}
+	tables.first_dominator.emplace_back(tables.dominators.size());
+
+	//every step lowers this, so sorting by it puts dominators first:
+	// (unused yarns and no crossing yet count as longer ago than anything else)
+	auto height = [](State const &state) {
+		uint32_t sum = (state.last_cross == 0 ? 0x100 : state.last_cross);
+		for (uint8_t count : state.last_used) {
+			sum += (count == 0 ? 0x100 : count);
+		}
+		return sum;
+	};
+	tables.dominance_order.resize(tables.states.size());
+	std::iota(tables.dominance_order.begin(), tables.dominance_order.end(), 0);
+	std::stable_sort(tables.dominance_order.begin(), tables.dominance_order.end(), [&](uint32_t a, uint32_t b){
+		return height(tables.states[a]) < height(tables.states[b]);
+	});
+
+	auto after = std::chrono::high_resolution_clock::now();
+	log << "Found " << tables.dominators.size() << " one-step dominance relations between " << tables.states.size() << " states in " << std::chrono::duration< double >(after - before).count() * 1000.0 << "ms." << std::endl;
+}
+
+//---------------------------------------
+//table cache files:
+// header (below), then:
+//   states, (yarns + 1) bytes each (last_used..., last_cross), padded to 8 bytes
+//   first_from (state count + 1), steady_froms_end (steady state count), froms, padded to 8 bytes
+//   reachable masks (mask count of them, (state count + 63) / 64 words each)
+// The checksum covers everything after the header.
+
+namespace {
+
+constexpr uint32_t CACHE_MAGIC = 0x4354444b; //'KDTC' when read as bytes
+constexpr uint32_t CACHE_VERSION = 2;
+
+struct CacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t yarns;
+	uint32_t use_within;
+	uint32_t cross_within;
+	uint32_t state_count;
+	uint32_t steady_states;
+	uint32_t warmup;
+	uint32_t froms_count;
+	uint32_t mask_count;
+	uint64_t payload_size; //in bytes, multiple of 8
+	uint64_t checksum;
+};
+static_assert(sizeof(CacheHeader) == 56, "Header packs as expected.");
+
+//word-at-a-time hash over the payload (not cryptographic, just catches truncated/damaged files):
+uint64_t checksum(uint8_t const *data, size_t size) {
+	assert(size % 8 == 0);
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t w;
+		std::memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+size_t pad(size_t size, size_t to) {
+	return (size + to - 1) / to * to;
+}
+
+}
+
+bool load_tables(std::string const &filename, DitherParams const &params, Tables *tables_) {
+	assert(tables_);
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+
+	void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return false;
+
+	auto mapping = std::make_unique< Tables::Mapping >(data, size);
+	uint8_t const *bytes = reinterpret_cast< uint8_t const * >(data);
+
+	auto reject = [&](std::string const &why) {
+		std::cerr << "WARNING: ignoring table cache '" << filename << "': " << why << std::endl;
+		return false;
+	};
+
+	CacheHeader header;
+	std::memcpy(&header, bytes, sizeof(header));
+	if (header.magic != CACHE_MAGIC) return reject("not a table cache file.");
+	if (header.version != CACHE_VERSION) return reject("version " + std::to_string(header.version) + " (expecting " + std::to_string(CACHE_VERSION) + ").");
+	if (header.yarns != params.yarns_linear.size()
+	 || header.use_within != params.use_within
+	 || header.cross_within != params.cross_within) return reject("built for different parameters.");
+	if (header.payload_size != size - sizeof(header) || header.payload_size % 8 != 0) return reject("wrong size (truncated?).");
+	if (header.checksum != checksum(bytes + sizeof(header), header.payload_size)) return reject("checksum mismatch.");
+
+	Tables ret;
+
+	uint32_t const yarns = header.yarns;
+	size_t const mask_words = (size_t(header.state_count) + 63) / 64;
+	size_t const expected_size = pad(size_t(header.state_count) * (yarns + 1), 8)
+		+ pad((size_t(header.state_count) + 1 + header.steady_states + header.froms_count) * 4, 8)
+		+ size_t(header.mask_count) * mask_words * 8;
+	if (header.payload_size != expected_size) return reject("sizes don't match header.");
+	if (header.steady_states > header.state_count) return reject("more steady states than states.");
+
+	size_t at = sizeof(header);
+
+	ret.states.reserve(header.state_count);
+	for (uint32_t s = 0; s < header.state_count; ++s) {
+		State &state = ret.states.emplace_back(yarns);
+		for (uint32_t y = 0; y < yarns; ++y) {
+			state.last_used[y] = bytes[at++];
+		}
+		state.last_cross = bytes[at++];
+	}
+	at = pad(at, 8);
+
+	auto read_u32s = [&](size_t count) {
+		std::span< uint32_t const > ret(reinterpret_cast< uint32_t const * >(bytes + at), count);
+		at += count * 4;
+		return ret;
+	};
+	ret.first_from = read_u32s(size_t(header.state_count) + 1);
+	ret.steady_froms_end = read_u32s(header.steady_states);
+	ret.froms = read_u32s(header.froms_count);
+	at = pad(at, 8);
+
+	for (uint32_t m = 0; m < header.mask_count; ++m) {
+		ret.reachable.emplace_back(reinterpret_cast< uint64_t const * >(bytes + at), mask_words);
+		at += mask_words * 8;
+	}
+	assert(at == size);
+
+	ret.steady_states = header.steady_states;
+	ret.warmup = header.warmup;
+	if (ret.reachable.size() != ret.warmup) return reject("wrong number of warm-up masks.");
+	if (ret.first_from.back() != ret.froms.size()) return reject("transition counts don't match.");
+
+	ret.mapping = std::move(mapping);
+	*tables_ = std::move(ret);
+	return true;
+}
+
+bool save_tables(std::string const &filename, DitherParams const &params, Tables const &tables) {
+	uint32_t const yarns = params.yarns_linear.size();
+
+	std::vector< uint8_t > payload;
+	auto write_words = [&](auto const &vs) {
+		payload.insert(payload.end(), reinterpret_cast< uint8_t const * >(vs.data()), reinterpret_cast< uint8_t const * >(vs.data() + vs.size()));
+	};
+
+	for (State const &state : tables.states) {
+		assert(state.last_used.size() == yarns);
+		for (uint32_t y = 0; y < yarns; ++y) {
+			payload.emplace_back(state.last_used[y]);
+		}
+		payload.emplace_back(state.last_cross);
+	}
+	payload.resize(pad(payload.size(), 8), 0);
+	write_words(tables.first_from);
+	write_words(tables.steady_froms_end);
+	write_words(tables.froms);
+	payload.resize(pad(payload.size(), 8), 0);
+	for (auto const &mask : tables.reachable) {
+		assert(mask.size() == (tables.states.size() + 63) / 64);
+		write_words(mask);
+	}
+
+	CacheHeader header{
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.yarns = yarns,
+		.use_within = params.use_within,
+		.cross_within = params.cross_within,
+		.state_count = uint32_t(tables.states.size()),
+		.steady_states = tables.steady_states,
+		.warmup = tables.warmup,
+		.froms_count = uint32_t(tables.froms.size()),
+		.mask_count = uint32_t(tables.reachable.size()),
+		.payload_size = payload.size(),
+		.checksum = checksum(payload.data(), payload.size()),
+	};
+
+	//write to a temporary file and rename, so other runs never see a partial cache:
+	std::string temp = filename + ".tmp" + std::to_string(getpid());
+	{
+		std::ofstream out(temp, std::ios::binary);
+		out.write(reinterpret_cast< char const * >(&header), sizeof(header));
+		out.write(reinterpret_cast< char const * >(payload.data()), payload.size());
+		if (!out) {
+			std::cerr << "WARNING: failed to write table cache '" << temp << "'." << std::endl;
+			std::filesystem::remove(temp);
+			return false;
+		}
+	}
+	std::error_code ec;
+	std::filesystem::rename(temp, filename, ec);
+	if (ec) {
+		std::cerr << "WARNING: failed to move table cache into place at '" << filename << "': " << ec.message() << std::endl;
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+Tables get_tables(DitherParams const &params, JobQueue *job_queue) {
+	std::ostream &log = *params.log;
+	if (params.table_cache == "") {
+		return build_tables(params, params.image_width, job_queue);
+	}
+
+	std::string filename = params.table_cache + "/tables"
+		+ "-y" + std::to_string(params.yarns_linear.size())
+		+ "-u" + std::to_string(params.use_within)
+		+ "-x" + std::to_string(params.cross_within)
+		+ ".bin";
+
+	Tables tables;
+
+	auto before = std::chrono::high_resolution_clock::now();
+	if (load_tables(filename, params, &tables)) {
+		auto after = std::chrono::high_resolution_clock::now();
+		log << "Loaded transition automaton with " << tables.states.size() << " states from '" << filename << "' in " << std::chrono::duration< double >(after - before).count() * 1000.0 << "ms." << std::endl;
+		return tables;
+	}
+
+	//cached tables are built all the way to convergence so they can be used for any image width:
+	tables = build_tables(params, -1U, job_queue);
+
+	std::error_code ec;
+	std::filesystem::create_directories(params.table_cache, ec);
+	if (ec) {
+		std::cerr << "WARNING: failed to create table cache directory '" << params.table_cache << "': " << ec.message() << std::endl;
+	} else if (save_tables(filename, params, tables)) {
+		log << "Saved transition tables to '" << filename << "'." << std::endl;
+	}
+
+	return tables;
+}